@@ -0,0 +1,177 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Development tool: time the per-entry cost of reading a directory
+ * listing, with and without the listing cache (see dircache.c).
+ * For each size given (by default, 10000 and 100000), a directory of
+ * that many empty files is made in a temporary directory, which also
+ * serves as CACHEDIR (this is built with CACHEDIR as "."), then:
+ *   a cache miss reads the directory, stats each entry, and writes the
+ *   listing, as get_dir() does;
+ *   a cache hit reads the listing back.
+ * The best of several runs of each is printed.
+ */
+
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+#define	BENCH_RUNS 5
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+count(const char *name, const struct fattr *attr, void *arg)
+{
+
+	(*(size_t *)arg)++;
+}
+
+/*
+ * Read "dfd", "dst", and cache its listing.
+ * Returns the number of entries.
+ */
+static size_t
+bench_miss(const struct sys *sys, int dfd, const struct stat *dst)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	struct fattr	 attr;
+	struct dircache	*dc;
+	int		 fd;
+	size_t		 n = 0;
+
+	if ((dc = dircache_create(sys, dst)) == NULL)
+		errx(1, "listing not cached");
+	if ((fd = dup(dfd)) == -1 || (dir = fdopendir(fd)) == NULL)
+		err(1, "fdopendir");
+	rewinddir(dir);
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.' ||
+		    fstatat(dfd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		fattr_stat(&attr, &st);
+		dircache_add(dc, dp->d_name, &attr);
+		n++;
+	}
+	closedir(dir);
+	dircache_finish(dc);
+	return n;
+}
+
+static void
+bench(const struct sys *sys, size_t files)
+{
+	char		 name[32];
+	int		 dfd, fd;
+	size_t		 i, n;
+	struct stat	 dst;
+	struct timespec	 ts[2];
+	double		 t, miss = 0.0, hit = 0.0;
+
+	snprintf(name, sizeof(name), "d%zu", files);
+	if (mkdir(name, 0700) == -1 ||
+	    (dfd = open(name, O_RDONLY|O_DIRECTORY, 0)) == -1)
+		err(1, "%s", name);
+	for (i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%08zu", i);
+		if ((fd = openat(dfd, name,
+		    O_WRONLY|O_CREAT|O_EXCL, 0600)) == -1)
+			err(1, "%s", name);
+		close(fd);
+	}
+
+	/* Listings of just-modified directories aren't cached. */
+
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = time(NULL) - 60;
+	ts[1].tv_nsec = 0;
+	if (futimens(dfd, ts) == -1 || fstat(dfd, &dst) == -1)
+		err(1, "futimens");
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		t = now();
+		if ((n = bench_miss(sys, dfd, &dst)) != files)
+			errx(1, "miss: %zu entries", n);
+		t = now() - t;
+		if (i == 0 || t < miss)
+			miss = t;
+
+		n = 0;
+		t = now();
+		if (dircache_load(sys, &dst, count, &n) <= 0 || n != files)
+			errx(1, "hit: %zu entries", n);
+		t = now() - t;
+		if (i == 0 || t < hit)
+			hit = t;
+	}
+
+	printf("%zu entries: miss %.0f ns, hit %.0f ns per entry\n",
+		files, miss * 1e9 / files, hit * 1e9 / files);
+	close(dfd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sys	 sys;
+	char		 tmp[] = "/tmp/httpdrop-bench.XXXXXXXXXX";
+	char		 cmd[64];
+	const char	*er;
+	size_t		 files;
+	int		 i;
+
+	memset(&sys, 0, sizeof(struct sys));
+	if (mkdtemp(tmp) == NULL || chdir(tmp) == -1)
+		err(1, "%s", tmp);
+
+	if (argc < 2) {
+		bench(&sys, 10000);
+		bench(&sys, 100000);
+	}
+	for (i = 1; i < argc; i++) {
+		files = strtonum(argv[i], 1, 10000000, &er);
+		if (er != NULL)
+			errx(1, "%s: %s", argv[i], er);
+		bench(&sys, files);
+	}
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp);
+	return system(cmd) != 0;
+}
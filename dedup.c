@@ -0,0 +1,343 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Content-addressed storage of uploaded files.
+ * Each distinct content is stored once in BLOBDIR, named by its
+ * SHA-256, and every uploaded file with that content is a hard link to
+ * it.
+ * This is safe because uploads never modify files in place: they're
+ * always renamed over (see stage_close()).
+ */
+
+/*
+ * Running statistics, kept in BLOBDIR/.stats.
+ */
+struct	dedupstat {
+	int64_t		 uploads; /* files uploaded */
+	int64_t		 hits; /* ...that were already stored */
+	int64_t		 logical; /* bytes uploaded */
+	int64_t		 stored; /* bytes actually stored */
+};
+
+/*
+ * Open (creating if needed) our blob directory.
+ * Returns the descriptor or -1 on failure.
+ */
+static int
+dedup_dir(const struct sys *sys)
+{
+	int	 fd;
+
+	fd = open(BLOBDIR, O_RDONLY|O_DIRECTORY, 0);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir(BLOBDIR, 0700) == -1 && errno != EEXIST) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: mkdir", BLOBDIR);
+			return -1;
+		}
+		fd = open(BLOBDIR, O_RDONLY|O_DIRECTORY, 0);
+	}
+	if (fd == -1)
+		kutil_warn(&sys->req, sys->curuser, "%s", BLOBDIR);
+	return fd;
+}
+
+/*
+ * Account for an upload of "size" bytes, which was a "hit" if already
+ * stored, then log the running deduplication ratio.
+ * Errors are logged but otherwise ignored.
+ */
+static void
+dedup_account(const struct sys *sys, int bfd, int hit, int64_t size)
+{
+	int		 fd;
+	FILE		*f;
+	struct dedupstat st;
+
+	if ((fd = openat(bfd, ".stats", O_RDWR|O_CREAT, 0600)) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/.stats", BLOBDIR);
+		return;
+	} else if (flock(fd, LOCK_EX) == -1 ||
+	    (f = fdopen(fd, "r+")) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/.stats", BLOBDIR);
+		close(fd);
+		return;
+	}
+
+	memset(&st, 0, sizeof(struct dedupstat));
+	if (fscanf(f, "uploads %" SCNd64 "\nhits %" SCNd64
+	    "\nlogical %" SCNd64 "\nstored %" SCNd64 "\n",
+	    &st.uploads, &st.hits, &st.logical, &st.stored) != 4)
+		memset(&st, 0, sizeof(struct dedupstat));
+
+	st.uploads++;
+	st.logical += size;
+	if (hit)
+		st.hits++;
+	else
+		st.stored += size;
+
+	rewind(f);
+	if (ftruncate(fd, 0) == -1 ||
+	    fprintf(f, "uploads %" PRId64 "\nhits %" PRId64
+	    "\nlogical %" PRId64 "\nstored %" PRId64 "\n"
+	    "ratio %.2f\n", st.uploads, st.hits, st.logical,
+	    st.stored, st.stored > 0 ?
+	    (double)st.logical / st.stored : 1.0) < 0 ||
+	    fflush(f) == EOF)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/.stats", BLOBDIR);
+
+	kutil_info(&sys->req, sys->curuser, "dedup: %s, %" PRId64
+		" bytes; %" PRId64 "/%" PRId64 " uploads deduplicated, "
+		"ratio %.2f", hit ? "hit" : "miss", size, st.hits,
+		st.uploads, st.stored > 0 ?
+		(double)st.logical / st.stored : 1.0);
+
+	/* Closing releases the lock after the buffer is written. */
+
+	fclose(f);
+}
+
+/*
+ * Hash all of the open file "fd" from its start into the hexadecimal
+ * string "hex" of size SHA256_DIGEST_STRING_LENGTH.
+ * Returns zero on read failure, non-zero on success.
+ */
+int
+dedup_hash_fd(int fd, char *hex)
+{
+	SHA2_CTX	 ctx;
+	char		 buf[65536];
+	ssize_t		 ssz;
+	off_t		 off = 0;
+
+	SHA256Init(&ctx);
+	while ((ssz = pread(fd, buf, sizeof(buf), off)) > 0) {
+		SHA256Update(&ctx, (uint8_t *)buf, ssz);
+		off += ssz;
+	}
+	SHA256End(&ctx, hex);
+	return ssz == 0;
+}
+
+/*
+ * Try to link the stored blob "hex" of "size" bytes into the directory
+ * "dfd" as "name", replacing whatever's there.
+ * This is how re-uploads of known content cost no writes at all.
+ * Returns -1 on system error, zero if there's no such blob (or it can't
+ * take more links), and non-zero on success.
+ */
+int
+dedup_link(const struct sys *sys, int dfd,
+	const char *name, const char *hex, int64_t size)
+{
+	int		 bfd, rc = -1;
+	char		 tmp[32];
+	struct stat	 st, nst;
+
+	if ((bfd = dedup_dir(sys)) == -1)
+		return -1;
+
+	if (fstatat(bfd, hex, &st, 0) == -1) {
+		rc = errno == ENOENT ? 0 : -1;
+		if (rc)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s", BLOBDIR, hex);
+		goto out;
+	} else if (st.st_size != size) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: size mismatch", BLOBDIR, hex);
+		goto out;
+	}
+
+	/* Already this content: nothing to link. */
+
+	if (fstatat(dfd, name, &nst, AT_SYMLINK_NOFOLLOW) != -1 &&
+	    nst.st_dev == st.st_dev && nst.st_ino == st.st_ino) {
+		dedup_account(sys, bfd, 1, size);
+		rc = 1;
+		goto out;
+	}
+
+	snprintf(tmp, sizeof(tmp), ".httpdrop.%08" PRIx32 "%08" PRIx32,
+		arc4random(), arc4random());
+	if (linkat(bfd, hex, dfd, tmp, 0) == -1) {
+		if ((rc = (errno == ENOENT || errno == EMLINK) ? 0 : -1))
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: linkat", BLOBDIR, hex);
+		goto out;
+	} else if (renameat(dfd, tmp, dfd, name) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: renameat", sys->resource, name);
+		unlinkat(dfd, tmp, 0);
+		goto out;
+	}
+
+	/*
+	 * Renaming over a link to the same file (if one appeared since
+	 * we looked) does nothing at all, so "tmp" may still be there.
+	 */
+
+	if (unlinkat(dfd, tmp, 0) == -1 && errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: unlinkat", sys->resource, tmp);
+
+	dedup_account(sys, bfd, 1, size);
+	rc = 1;
+out:
+	close(bfd);
+	return rc;
+}
+
+/*
+ * Publish the completely-written staging file "tmp" in "tdfd" as "name"
+ * in "dfd", where "hex" is the hash of its contents.
+ * If the content is already stored, link that instead and discard the
+ * staging file; otherwise, the staging file becomes the stored blob.
+ * The staging file is always gone upon return.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+dedup_publish(const struct sys *sys, int tdfd, const char *tmp,
+	int dfd, const char *name, const char *hex)
+{
+	int		 bfd, rc;
+	struct stat	 st;
+
+	if (fstatat(tdfd, tmp, &st, 0) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: fstatat", sys->resource, tmp);
+		unlinkat(tdfd, tmp, 0);
+		return 0;
+	}
+
+	if ((rc = dedup_link(sys, dfd, name, hex, st.st_size)) > 0) {
+		if (unlinkat(tdfd, tmp, 0) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: unlinkat", sys->resource, tmp);
+		return 1;
+	}
+
+	/*
+	 * Not yet stored: adopt the staging file as the blob.
+	 * If this fails (e.g., we lost a race to store the same
+	 * content), the file is still published, just not shared.
+	 */
+
+	if (rc == 0 && (bfd = dedup_dir(sys)) != -1) {
+		if (linkat(tdfd, tmp, bfd, hex, 0) == -1) {
+			if (errno != EEXIST)
+				kutil_warn(&sys->req, sys->curuser,
+					"%s/%s: linkat", BLOBDIR, hex);
+		} else
+			dedup_account(sys, bfd, 0, st.st_size);
+		close(bfd);
+	}
+
+	if (renameat(tdfd, tmp, dfd, name) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: renameat", sys->resource, name);
+		unlinkat(tdfd, tmp, 0);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Remove the blob of the open file "fd", "st", once named "name", if
+ * it's the file itself.
+ * This requires hashing the file, so only call it for the last
+ * reference.
+ */
+static void
+dedup_drop(const struct sys *sys, int fd,
+	const char *name, const struct stat *st)
+{
+	int		 bfd;
+	char		 hex[SHA256_DIGEST_STRING_LENGTH];
+	struct stat	 bst;
+
+	if ( ! dedup_hash_fd(fd, hex))
+		return;
+	if ((bfd = dedup_dir(sys)) == -1)
+		return;
+	if (fstatat(bfd, hex, &bst, 0) != -1 &&
+	    bst.st_dev == st->st_dev && bst.st_ino == st->st_ino) {
+		if (unlinkat(bfd, hex, 0) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: unlinkat", BLOBDIR, hex);
+		else
+			kutil_info(&sys->req, sys->curuser,
+				"%s/%s: dedup blob %s released",
+				sys->resource, name, hex);
+	}
+	close(bfd);
+}
+
+/*
+ * The file "st" named "name" in "dfd" is about to be removed.
+ * If its only other link is its blob, remove the blob as well.
+ */
+void
+dedup_unref(const struct sys *sys, int dfd,
+	const char *name, const struct stat *st)
+{
+	int	 fd;
+
+	if (st->st_nlink != 2)
+		return;
+	if ((fd = openat(dfd, name, O_RDONLY, 0)) == -1)
+		return;
+	dedup_drop(sys, fd, name, st);
+	close(fd);
+}
+
+/*
+ * The open file "fd" named "name" has just been replaced (see
+ * stage_done()).
+ * If it's now only linked as its blob, remove the blob as well.
+ */
+void
+dedup_replaced(const struct sys *sys, int fd, const char *name)
+{
+	struct stat	 st;
+
+	if (fstat(fd, &st) == -1 || st.st_nlink != 1)
+		return;
+	dedup_drop(sys, fd, name, &st);
+}
@@ -0,0 +1,64 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Start background work: fork a process that's neither our child nor
+ * holding the client's descriptors, so neither the response nor the
+ * client waits on it.
+ * Returns 1 in the parent (whether or not this worked) and 0 in the
+ * background process, which runs at a lower priority, may only use the
+ * file-system promises, and must finish with _exit(2), never returning
+ * or flushing anything kcgi has buffered.
+ * Needs the "proc" promise.
+ */
+int
+detach(const struct sys *sys)
+{
+	pid_t	 pid;
+
+	if ((pid = fork()) == -1) {
+		kutil_warn(&sys->req, sys->curuser, "fork");
+		return 1;
+	} else if (pid > 0) {
+		if (waitpid(pid, NULL, 0) == -1)
+			kutil_warn(&sys->req, sys->curuser, "waitpid");
+		return 1;
+	}
+
+	if ((pid = fork()) != 0)
+		_exit(pid == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	setsid();
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+
+	if (pledge("flock rpath wpath cpath stdio", NULL) == -1)
+		kutil_err(&sys->req, sys->curuser, "pledge");
+	if (setpriority(PRIO_PROCESS, 0, 10) == -1)
+		kutil_warn(&sys->req, sys->curuser, "setpriority");
+	return 0;
+}
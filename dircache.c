@@ -0,0 +1,731 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Directory listings cached in LISTDIR, one file per directory named
+ * by its device and inode.
+ * A cached listing is valid only for the directory modification time
+ * it was read at, which changes whenever an entry is added, removed, or
+ * renamed.
+ *
+ * Our own changes to a directory don't invalidate its listing.
+ * They're made between dircache_begin() and dircache_commit(), which
+ * hold the directory locked and, if its listing was valid before the
+ * change, append the changed entry and make the listing valid for the
+ * directory as it is after.
+ * Appended entries (deletions having no mode) replace any of the same
+ * name; when there are too many, the listing is rewritten.
+ *
+ * So a directory is only read when first listed, when changed by other
+ * means, and every DIRCACHE_MAXAGE to reconcile in-place changes to its
+ * files by other means, which don't change the directory itself.
+ */
+
+#define	DIRCACHE_MAGIC	 "httpdls3"
+#define	DIRCACHE_MAXAGE	 (60 * 60) /* seconds between reads */
+#define	DIRCACHE_DELTAS	 256 /* most appended entries */
+#define	DIRCACHE_BUFSZ	 (64 * 1024) /* reading window */
+
+/*
+ * Start of the cache file, identifying the directory state.
+ * It's followed by the entries as read, then those appended.
+ */
+struct	dchead {
+	char		 magic[8];
+	uint64_t	 dev;
+	uint64_t	 ino;
+	int64_t		 mtime; /* seconds */
+	int64_t		 mtimensec; /* nanoseconds */
+	uint64_t	 entsz; /* number of entries read */
+	uint64_t	 basesz; /* bytes of entries read */
+	uint64_t	 deltas; /* number of entries appended */
+	uint64_t	 deltasz; /* bytes of entries appended */
+	int64_t		 scanned; /* when read */
+};
+
+/*
+ * One entry, followed by its name (without the NUL).
+ * With 64-bit alignment, this is 48 bytes: struct fattr pads to 40,
+ * then "namesz" pads to 8.
+ */
+struct	dcent {
+	struct fattr	 attr;
+	uint32_t	 namesz;
+};
+
+/*
+ * An appended entry, when loaded.
+ */
+struct	dcdelta {
+	struct fattr	 attr; /* no mode if deleted */
+	size_t		 seq; /* order appended */
+	char		 name[NAME_MAX + 1];
+};
+
+/*
+ * A listing being written.
+ */
+struct	dircache {
+	const struct sys *sys;
+	struct stat	 dst; /* directory */
+	int64_t		 scanned; /* when read */
+	int		 dfd; /* LISTDIR */
+	int		 fd; /* temporary file */
+	int		 error; /* write failed */
+	char		 name[64]; /* cache file */
+	char		 tmp[80]; /* temporary file */
+	char		 buf[64 * 1024]; /* pending output */
+	size_t		 bufsz; /* bytes pending */
+	uint64_t	 entsz; /* entries written */
+	uint64_t	 basesz; /* bytes of entries written */
+};
+
+/*
+ * A change to a directory in progress.
+ */
+struct	dirtx {
+	const struct sys *sys;
+	int		 fd; /* directory (locked) */
+	struct stat	 dst; /* directory before */
+};
+
+/*
+ * Rewriting a listing, all but the entry "name".
+ */
+struct	dcrewrite {
+	struct dircache	*dc;
+	const char	*name;
+};
+
+/*
+ * Open (creating if needed) our cache directory.
+ * Returns the descriptor or -1 on failure.
+ */
+static int
+dircache_dir(const struct sys *sys)
+{
+	int	 fd;
+
+	fd = open(LISTDIR, O_RDONLY|O_DIRECTORY, 0);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir(LISTDIR, 0700) == -1 && errno != EEXIST) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: mkdir", LISTDIR);
+			return -1;
+		}
+		fd = open(LISTDIR, O_RDONLY|O_DIRECTORY, 0);
+	}
+	if (fd == -1)
+		kutil_warn(&sys->req, sys->curuser, "%s", LISTDIR);
+	return fd;
+}
+
+static void
+dircache_name(const struct stat *dst, char *buf, size_t sz)
+{
+
+	snprintf(buf, sz, "%" PRIu64 "-%" PRIu64,
+		(uint64_t)dst->st_dev, (uint64_t)dst->st_ino);
+}
+
+/*
+ * Fill in the header describing directory "dst".
+ */
+static void
+dircache_head(const struct stat *dst, struct dchead *h)
+{
+
+	memset(h, 0, sizeof(struct dchead));
+	memcpy(h->magic, DIRCACHE_MAGIC, sizeof(h->magic));
+	h->dev = dst->st_dev;
+	h->ino = dst->st_ino;
+	h->mtime = dst->st_mtim.tv_sec;
+	h->mtimensec = dst->st_mtim.tv_nsec;
+}
+
+/*
+ * Read the header of the listing "fd" into "h".
+ * Returns zero if it's not (or no longer) the listing of "dst".
+ * A stale listing isn't an error: it's just replaced.
+ */
+static int
+dircache_valid(int fd, const struct stat *dst, struct dchead *h)
+{
+	struct dchead	 want;
+
+	dircache_head(dst, &want);
+	return pread(fd, h, sizeof(struct dchead), 0) ==
+		sizeof(struct dchead) &&
+		memcmp(h->magic, want.magic, sizeof(h->magic)) == 0 &&
+		h->dev == want.dev && h->ino == want.ino &&
+		h->mtime == want.mtime && h->mtimensec == want.mtimensec;
+}
+
+static int
+dcdelta_cmp(const void *p1, const void *p2)
+{
+	const struct dcdelta *d1 = p1, *d2 = p2;
+	int	 rc;
+
+	if ((rc = strcmp(d1->name, d2->name)) != 0)
+		return rc;
+	return d1->seq < d2->seq ? -1 : d1->seq > d2->seq;
+}
+
+static int
+dcdelta_cmp_name(const void *p1, const void *p2)
+{
+	const struct dcdelta *d1 = p1, *d2 = p2;
+
+	return strcmp(d1->name, d2->name);
+}
+
+/*
+ * Read the appended entries of the listing "fd" with header "h" into
+ * "ds", keeping only the last of each name, sorted by name.
+ * Returns how many or -1 if they're corrupt.
+ */
+static ssize_t
+dircache_deltas(int fd, const struct dchead *h, struct dcdelta **ds)
+{
+	char		*buf;
+	struct dcent	 e;
+	size_t		 off = 0, n, k;
+
+	*ds = NULL;
+	if (h->deltas == 0)
+		return 0;
+	if (h->deltas > DIRCACHE_DELTAS || h->deltasz >
+	    h->deltas * (sizeof(struct dcent) + NAME_MAX))
+		return -1;
+
+	buf = kmalloc(h->deltasz);
+	*ds = kcalloc(h->deltas, sizeof(struct dcdelta));
+	if (pread(fd, buf, h->deltasz, sizeof(struct dchead) +
+	    h->basesz) != (ssize_t)h->deltasz)
+		goto bad;
+
+	for (n = 0; n < h->deltas; n++) {
+		if (h->deltasz - off < sizeof(struct dcent))
+			goto bad;
+		memcpy(&e, buf + off, sizeof(struct dcent));
+		off += sizeof(struct dcent);
+		if (e.namesz == 0 || e.namesz > NAME_MAX ||
+		    h->deltasz - off < e.namesz)
+			goto bad;
+		(*ds)[n].attr = e.attr;
+		(*ds)[n].seq = n;
+		memcpy((*ds)[n].name, buf + off, e.namesz);
+		off += e.namesz;
+	}
+	free(buf);
+	if (off != h->deltasz)
+		return -1;
+
+	qsort(*ds, n, sizeof(struct dcdelta), dcdelta_cmp);
+	for (n = k = 0; n < h->deltas; n++) {
+		if (n + 1 < h->deltas &&
+		    strcmp((*ds)[n].name, (*ds)[n + 1].name) == 0)
+			continue;
+		(*ds)[k++] = (*ds)[n];
+	}
+	return k;
+bad:
+	free(buf);
+	return -1;
+}
+
+/*
+ * Stream the listing "fd" with header "h" (named "name") to "fn" with
+ * "arg", one entry at a time, so memory doesn't grow with the size of
+ * the directory.
+ * Returns 1 on success or -1 if the listing was corrupt (and "fn" may
+ * have been called).
+ */
+static int
+dircache_read(const struct sys *sys, int fd, const struct dchead *h,
+	const char *name, dircache_fn fn, void *arg)
+{
+	char		 fname[NAME_MAX + 1], *buf;
+	size_t		 have = 0, off = 0, len;
+	off_t		 pos = sizeof(struct dchead);
+	struct dcent	 e;
+	struct dcdelta	*ds, key;
+	uint64_t	 i;
+	ssize_t		 ssz, dsz;
+	int		 rc = -1;
+
+	buf = kmalloc(DIRCACHE_BUFSZ);
+	if ((dsz = dircache_deltas(fd, h, &ds)) == -1)
+		goto bad;
+
+	for (i = 0; i < h->entsz; i++) {
+		/* Refill when we can't be sure of a whole record. */
+
+		if (have - off < sizeof(struct dcent) + NAME_MAX &&
+		    (uint64_t)pos < sizeof(struct dchead) + h->basesz) {
+			memmove(buf, buf + off, have - off);
+			have -= off;
+			off = 0;
+			len = DIRCACHE_BUFSZ - have;
+			if (len > sizeof(struct dchead) + h->basesz - pos)
+				len = sizeof(struct dchead) +
+					h->basesz - pos;
+			if ((ssz = pread(fd, buf + have, len, pos)) == -1) {
+				kutil_warn(&sys->req, sys->curuser,
+					"%s/%s: read", LISTDIR, name);
+				goto out;
+			}
+			have += ssz;
+			pos += ssz;
+		}
+
+		if (have - off < sizeof(struct dcent))
+			goto bad;
+		memcpy(&e, buf + off, sizeof(struct dcent));
+		off += sizeof(struct dcent);
+		len = e.namesz;
+		if (len == 0 || len > NAME_MAX || have - off < len)
+			goto bad;
+		memcpy(fname, buf + off, len);
+		fname[len] = '\0';
+		off += len;
+
+		/* Appended entries replace those read. */
+
+		if (dsz > 0) {
+			strlcpy(key.name, fname, sizeof(key.name));
+			if (bsearch(&key, ds, dsz,
+			    sizeof(struct dcdelta), dcdelta_cmp_name))
+				continue;
+		}
+		(*fn)(fname, &e.attr, arg);
+	}
+
+	if (off != have ||
+	    (uint64_t)pos != sizeof(struct dchead) + h->basesz)
+		goto bad;
+
+	for (i = 0; i < (uint64_t)dsz; i++)
+		if (ds[i].attr.mode != 0)
+			(*fn)(ds[i].name, &ds[i].attr, arg);
+	rc = 1;
+	goto out;
+bad:
+	kutil_warnx(&sys->req, sys->curuser,
+		"%s/%s: bad listing cache", LISTDIR, name);
+out:
+	free(ds);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Stream the cached listing of the directory "dst", if valid, to "fn"
+ * with "arg" (see dircache_read()).
+ * Returns 1 on success, 0 if there's no valid cached listing (and "fn"
+ * was never called), or -1 if the listing was corrupt partway through
+ * (and "fn" may have been called).
+ */
+int
+dircache_load(const struct sys *sys, const struct stat *dst,
+	dircache_fn fn, void *arg)
+{
+	int		 dfd, fd, rc;
+	char		 name[64];
+	struct dchead	 h;
+
+	dircache_name(dst, name, sizeof(name));
+	if ((dfd = open(LISTDIR, O_RDONLY|O_DIRECTORY, 0)) == -1)
+		return 0;
+	fd = openat(dfd, name, O_RDONLY, 0);
+	close(dfd);
+	if (fd == -1)
+		return 0;
+
+	/* Time to reconcile with the directory? */
+
+	if ( ! dircache_valid(fd, dst, &h) ||
+	    h.scanned < time(NULL) - DIRCACHE_MAXAGE) {
+		close(fd);
+		return 0;
+	}
+
+	rc = dircache_read(sys, fd, &h, name, fn, arg);
+	close(fd);
+	return rc;
+}
+
+/*
+ * Begin writing the listing of directory "dst", read at "scanned".
+ * Returns NULL on failure.
+ */
+static struct dircache *
+dircache_open(const struct sys *sys, const struct stat *dst,
+	int64_t scanned)
+{
+	struct dircache	*dc;
+	struct dchead	 h;
+
+	dc = kcalloc(1, sizeof(struct dircache));
+	dc->sys = sys;
+	dc->dst = *dst;
+	dc->scanned = scanned;
+	dircache_name(dst, dc->name, sizeof(dc->name));
+	snprintf(dc->tmp, sizeof(dc->tmp),
+		".%s.%08" PRIx32, dc->name, arc4random());
+
+	if ((dc->dfd = dircache_dir(sys)) == -1) {
+		free(dc);
+		return NULL;
+	}
+	dc->fd = openat(dc->dfd, dc->tmp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	if (dc->fd == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: openat", LISTDIR, dc->tmp);
+		close(dc->dfd);
+		free(dc);
+		return NULL;
+	}
+
+	/* The entry count is filled in when we're done. */
+
+	dircache_head(dst, &h);
+	memcpy(dc->buf, &h, sizeof(struct dchead));
+	dc->bufsz = sizeof(struct dchead);
+	return dc;
+}
+
+/*
+ * Begin caching the listing of directory "dst", which must be read
+ * after "dst" was stat'd.
+ * Entries are added with dircache_add() and the listing is written out
+ * with dircache_finish().
+ * Returns NULL if the listing isn't to be cached.
+ */
+struct dircache *
+dircache_create(const struct sys *sys, const struct stat *dst)
+{
+
+	/*
+	 * A directory modified within the last second could be modified
+	 * again without its timestamp changing, so our listing might
+	 * already be stale: don't cache it.
+	 */
+
+	if (dst->st_mtim.tv_sec >= time(NULL) - 1)
+		return NULL;
+	return dircache_open(sys, dst, time(NULL));
+}
+
+static void
+dircache_flush(struct dircache *dc)
+{
+
+	if (dc->bufsz > 0 && ! dc->error &&
+	    write(dc->fd, dc->buf, dc->bufsz) != (ssize_t)dc->bufsz) {
+		kutil_warn(&dc->sys->req, dc->sys->curuser,
+			"%s/%s: write", LISTDIR, dc->tmp);
+		dc->error = 1;
+	}
+	dc->bufsz = 0;
+}
+
+/*
+ * Add the entry "name" with status "attr" to the listing, if not NULL.
+ */
+void
+dircache_add(struct dircache *dc, const char *name, const struct fattr *attr)
+{
+	struct dcent	 e;
+	size_t		 namesz = strlen(name);
+
+	if (dc == NULL || namesz > NAME_MAX)
+		return;
+	if (dc->bufsz + sizeof(struct dcent) + namesz > sizeof(dc->buf))
+		dircache_flush(dc);
+
+	memset(&e, 0, sizeof(struct dcent));
+	e.attr = *attr;
+	e.namesz = namesz;
+	memcpy(dc->buf + dc->bufsz, &e, sizeof(struct dcent));
+	dc->bufsz += sizeof(struct dcent);
+	memcpy(dc->buf + dc->bufsz, name, namesz);
+	dc->bufsz += namesz;
+	dc->entsz++;
+	dc->basesz += sizeof(struct dcent) + namesz;
+}
+
+/*
+ * Write out the listing and free "dc", if not NULL.
+ * Errors are logged but otherwise ignored.
+ */
+void
+dircache_finish(struct dircache *dc)
+{
+	struct dchead	 h;
+
+	if (dc == NULL)
+		return;
+
+	dircache_flush(dc);
+	dircache_head(&dc->dst, &h);
+	h.entsz = dc->entsz;
+	h.basesz = dc->basesz;
+	h.scanned = dc->scanned;
+	if ( ! dc->error &&
+	    pwrite(dc->fd, &h, sizeof(struct dchead), 0) !=
+	    sizeof(struct dchead)) {
+		kutil_warn(&dc->sys->req, dc->sys->curuser,
+			"%s/%s: pwrite", LISTDIR, dc->tmp);
+		dc->error = 1;
+	}
+	close(dc->fd);
+
+	if ( ! dc->error &&
+	    renameat(dc->dfd, dc->tmp, dc->dfd, dc->name) == -1) {
+		kutil_warn(&dc->sys->req, dc->sys->curuser,
+			"%s/%s: renameat", LISTDIR, dc->tmp);
+		dc->error = 1;
+	}
+	if (dc->error)
+		unlinkat(dc->dfd, dc->tmp, 0);
+
+	close(dc->dfd);
+	free(dc);
+}
+
+/*
+ * Abandon the listing and free "dc", if not NULL.
+ */
+void
+dircache_discard(struct dircache *dc)
+{
+
+	if (dc == NULL)
+		return;
+	close(dc->fd);
+	unlinkat(dc->dfd, dc->tmp, 0);
+	close(dc->dfd);
+	free(dc);
+}
+
+/*
+ * Begin a change to the entries of directory "path" in "dfd" (which may
+ * be "." for "dfd" itself).
+ * The directory is locked against our other changes until
+ * dircache_commit(), so only do so around the change itself.
+ * Returns NULL on failure, which dircache_commit() accepts.
+ */
+struct dirtx *
+dircache_begin(const struct sys *sys, int dfd, const char *path)
+{
+	struct dirtx	*tx;
+
+	/* Our own descriptor, as locks are by open file. */
+
+	tx = kcalloc(1, sizeof(struct dirtx));
+	tx->sys = sys;
+	if ((tx->fd = openat(dfd, path, O_RDONLY|O_DIRECTORY, 0)) == -1 ||
+	    flock(tx->fd, LOCK_EX) == -1 ||
+	    fstat(tx->fd, &tx->dst) == -1) {
+		kutil_warn(&sys->req, sys->curuser, "%s", path);
+		if (tx->fd != -1)
+			close(tx->fd);
+		free(tx);
+		return NULL;
+	}
+	return tx;
+}
+
+static void
+dircache_rewrite_add(const char *name, const struct fattr *attr, void *arg)
+{
+	struct dcrewrite *rw = arg;
+
+	if (strcmp(name, rw->name))
+		dircache_add(rw->dc, name, attr);
+}
+
+/*
+ * Bring the listing of "tx" up to date with entry "name", now "attr",
+ * in the directory, now "dst".
+ * If "name" is NULL, no listed entry changed (e.g., only a dot-file),
+ * so the listing need only be made valid for "dst".
+ */
+static void
+dircache_patch(struct dirtx *tx, const struct stat *dst,
+	const char *name, const struct fattr *attr)
+{
+	int		 dfd, fd, ok = 0;
+	char		 fname[64], buf[sizeof(struct dcent) + NAME_MAX];
+	struct dchead	 h;
+	struct dcent	 e;
+	struct dcrewrite rw;
+	size_t		 namesz = name == NULL ? 0 : strlen(name);
+
+	if (namesz > NAME_MAX)
+		return;
+
+	dircache_name(&tx->dst, fname, sizeof(fname));
+	if ((dfd = open(LISTDIR, O_RDONLY|O_DIRECTORY, 0)) == -1)
+		return;
+	if ((fd = openat(dfd, fname, O_RDWR, 0)) == -1 ||
+	    ! dircache_valid(fd, &tx->dst, &h)) {
+		if (fd != -1)
+			close(fd);
+		close(dfd);
+		return;
+	}
+
+	/*
+	 * As in dircache_create(), a directory just modified could be
+	 * modified again (outside of httpdrop) without its timestamp
+	 * changing, if that's coarse: then don't vouch for the listing.
+	 * Finer timestamps (that aren't whole milliseconds) will change.
+	 */
+
+	if (dst->st_mtim.tv_sec >= time(NULL) - 1 &&
+	    dst->st_mtim.tv_nsec % 1000000 == 0) {
+		unlinkat(dfd, fname, 0);
+		close(fd);
+		close(dfd);
+		return;
+	}
+
+	if (name == NULL) {
+		/* Only the header's timestamp. */
+
+		h.mtime = dst->st_mtim.tv_sec;
+		h.mtimensec = dst->st_mtim.tv_nsec;
+		ok = pwrite(fd, &h, sizeof(struct dchead), 0) ==
+			sizeof(struct dchead);
+	} else if (h.deltas < DIRCACHE_DELTAS) {
+		/* Append, then commit by validating the listing. */
+
+		memset(&e, 0, sizeof(struct dcent));
+		e.attr = *attr;
+		e.namesz = namesz;
+		memcpy(buf, &e, sizeof(struct dcent));
+		memcpy(buf + sizeof(struct dcent), name, namesz);
+		if (pwrite(fd, buf, sizeof(struct dcent) + namesz,
+		    sizeof(struct dchead) + h.basesz + h.deltasz) ==
+		    (ssize_t)(sizeof(struct dcent) + namesz)) {
+			h.deltas++;
+			h.deltasz += sizeof(struct dcent) + namesz;
+			h.mtime = dst->st_mtim.tv_sec;
+			h.mtimensec = dst->st_mtim.tv_nsec;
+			ok = pwrite(fd, &h, sizeof(struct dchead), 0) ==
+				sizeof(struct dchead);
+		}
+	} else if ((rw.dc = dircache_open(tx->sys,
+	    dst, h.scanned)) != NULL) {
+		/* Rewrite with all changes folded in. */
+
+		rw.name = name;
+		if (dircache_read(tx->sys, fd, &h, fname,
+		    dircache_rewrite_add, &rw) > 0) {
+			if (attr->mode != 0)
+				dircache_add(rw.dc, name, attr);
+			ok = ! rw.dc->error;
+			dircache_finish(rw.dc);
+		} else
+			dircache_discard(rw.dc);
+	}
+
+	/* Don't leave a listing valid for the directory as it was. */
+
+	if ( ! ok) {
+		kutil_warnx(&tx->sys->req, tx->sys->curuser,
+			"%s/%s: listing not updated", LISTDIR, fname);
+		unlinkat(dfd, fname, 0);
+	}
+	close(fd);
+	close(dfd);
+}
+
+/*
+ * Finish the change begun with dircache_begin(), if not NULL, to the
+ * entry "name", or NULL if no listed entry was changed (nothing at all,
+ * or only dot-files such as staging files).
+ * This brings the directory's cached listing, if valid before the
+ * change, up to date, and frees "tx".
+ */
+void
+dircache_commit(struct dirtx *tx, const char *name)
+{
+	struct stat	 st, dst;
+	struct fattr	 attr;
+
+	if (tx == NULL)
+		return;
+
+	/* Entries are as listed: see get_dir_want(). */
+
+	if (fstat(tx->fd, &dst) == -1)
+		goto out;
+	if (name == NULL) {
+		if (dst.st_mtim.tv_sec != tx->dst.st_mtim.tv_sec ||
+		    dst.st_mtim.tv_nsec != tx->dst.st_mtim.tv_nsec)
+			dircache_patch(tx, &dst, NULL, NULL);
+	} else {
+		memset(&attr, 0, sizeof(struct fattr));
+		if (fstatat(tx->fd, name, &st, AT_SYMLINK_NOFOLLOW) != -1 &&
+		    (S_ISDIR(st.st_mode) ||
+		     (S_ISREG(st.st_mode) && name[0] != '.')))
+			fattr_stat(&attr, &st);
+		dircache_patch(tx, &dst, name, &attr);
+	}
+out:
+
+	close(tx->fd);
+	free(tx);
+}
+
+/*
+ * Fill in "attr" from "st".
+ */
+void
+fattr_stat(struct fattr *attr, const struct stat *st)
+{
+
+	memset(attr, 0, sizeof(struct fattr));
+	attr->size = st->st_size;
+	attr->ctime = st->st_ctim.tv_sec;
+	attr->mtime = st->st_mtim.tv_sec;
+	attr->mode = st->st_mode;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+}
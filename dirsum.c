@@ -0,0 +1,404 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Recursive totals of directories kept in SUMDIR, one file per
+ * directory named by the hash of its path under FILEDIR.
+ * Our own mutation paths adjust the totals of a directory and all of
+ * its ancestors as they go, so listings never need to walk a subtree.
+ * Anything else (changes by other means, lost races between uploads)
+ * makes the totals drift: they're rebuilt by walking the subtree in the
+ * background when missing or older than DIRSUM_MAXAGE.
+ * Like listings, totals count regular files not starting with a dot and
+ * directories, and don't follow symbolic links.
+ */
+
+#define	DIRSUM_MAGIC	 "httpdsm1"
+#define	DIRSUM_MAXAGE	 (24 * 60 * 60) /* seconds between rebuilds */
+#define	DIRSUM_MAXDEPTH	 64 /* deepest directory walked */
+#define	DIRSUM_LOCK	 ".rebuild" /* held while rebuilding */
+
+/*
+ * The contents of a totals file.
+ */
+struct	dsfile {
+	char		 magic[8];
+	struct dirsum	 sum;
+};
+
+/*
+ * Open (creating if needed) our totals directory.
+ * Returns the descriptor or -1 on failure.
+ */
+static int
+dirsum_dir(const struct sys *sys)
+{
+	int	 fd;
+
+	fd = open(SUMDIR, O_RDONLY|O_DIRECTORY, 0);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir(SUMDIR, 0700) == -1 && errno != EEXIST) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: mkdir", SUMDIR);
+			return -1;
+		}
+		fd = open(SUMDIR, O_RDONLY|O_DIRECTORY, 0);
+	}
+	if (fd == -1)
+		kutil_warn(&sys->req, sys->curuser, "%s", SUMDIR);
+	return fd;
+}
+
+static void
+dirsum_name(const char *path, char *buf)
+{
+
+	SHA256Data((const uint8_t *)path, strlen(path), buf);
+}
+
+/*
+ * Read the totals of "path" from the open file "fd" into "ds".
+ * Returns zero if they're not there or are corrupt.
+ */
+static int
+dirsum_read(int fd, struct dirsum *ds)
+{
+	struct dsfile	 f;
+
+	if (pread(fd, &f, sizeof(struct dsfile), 0) !=
+	    sizeof(struct dsfile) ||
+	    memcmp(f.magic, DIRSUM_MAGIC, sizeof(f.magic)))
+		return 0;
+	*ds = f.sum;
+	return 1;
+}
+
+static int
+dirsum_write(int fd, const struct dirsum *ds)
+{
+	struct dsfile	 f;
+
+	memset(&f, 0, sizeof(struct dsfile));
+	memcpy(f.magic, DIRSUM_MAGIC, sizeof(f.magic));
+	f.sum = *ds;
+	return pwrite(fd, &f, sizeof(struct dsfile), 0) ==
+		sizeof(struct dsfile);
+}
+
+/*
+ * Replace the totals of "path" in the totals directory "sfd".
+ */
+static void
+dirsum_put(const struct sys *sys, int sfd,
+	const char *path, const struct dirsum *ds)
+{
+	int	 fd;
+	char	 name[SHA256_DIGEST_STRING_LENGTH];
+
+	dirsum_name(path, name);
+	if ((fd = openat(sfd, name, O_RDWR|O_CREAT, 0600)) == -1 ||
+	    flock(fd, LOCK_EX) == -1 || ! dirsum_write(fd, ds))
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: %s", SUMDIR, name, path);
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Get the totals of the directory "path" into "ds".
+ * Returns zero if there are none, in which case "ds" is zeroed.
+ */
+int
+dirsum_get(const struct sys *sys, const char *path, struct dirsum *ds)
+{
+	int	 sfd, fd, rc = 0;
+	char	 name[SHA256_DIGEST_STRING_LENGTH];
+
+	memset(ds, 0, sizeof(struct dirsum));
+	if ((sfd = open(SUMDIR, O_RDONLY|O_DIRECTORY, 0)) == -1)
+		return 0;
+	dirsum_name(path, name);
+	fd = openat(sfd, name, O_RDONLY, 0);
+	close(sfd);
+	if (fd == -1)
+		return 0;
+	if (flock(fd, LOCK_SH) == -1)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: flock", SUMDIR, name);
+	else if ((rc = dirsum_read(fd, ds)) == 0)
+		memset(ds, 0, sizeof(struct dirsum));
+	close(fd);
+	return rc;
+}
+
+/*
+ * Whether the totals "ds" (if "have") should be rebuilt.
+ */
+int
+dirsum_stale(const struct dirsum *ds, int have)
+{
+
+	return ! have || ds->stamp < time(NULL) - DIRSUM_MAXAGE;
+}
+
+/*
+ * Add the given changes to the totals of the directory "path" and each
+ * of its ancestors.
+ * Missing totals are left alone: they'll be rebuilt when next needed.
+ */
+void
+dirsum_adjust(const struct sys *sys, const char *path,
+	int64_t bytes, int64_t files, int64_t dirs)
+{
+	int		 sfd, fd;
+	char		 name[SHA256_DIGEST_STRING_LENGTH];
+	char		*buf, *cp;
+	struct dirsum	 ds;
+
+	if ((sfd = dirsum_dir(sys)) == -1)
+		return;
+	buf = kstrdup(path);
+
+	for (;;) {
+		dirsum_name(buf, name);
+		if ((fd = openat(sfd, name, O_RDWR, 0)) != -1) {
+			if (flock(fd, LOCK_EX) == -1 ||
+			    ! dirsum_read(fd, &ds)) {
+				kutil_warnx(&sys->req, sys->curuser,
+					"%s/%s: bad totals: %s",
+					SUMDIR, name, buf);
+				unlinkat(sfd, name, 0);
+			} else {
+				ds.bytes += bytes;
+				ds.files += files;
+				ds.dirs += dirs;
+				if ( ! dirsum_write(fd, &ds))
+					kutil_warn(&sys->req,
+						sys->curuser, "%s/%s: "
+						"pwrite", SUMDIR, name);
+			}
+			close(fd);
+		}
+		if (buf[0] == '\0')
+			break;
+		if ((cp = strrchr(buf, '/')) != NULL)
+			*cp = '\0';
+		else
+			buf[0] = '\0';
+	}
+
+	free(buf);
+	close(sfd);
+}
+
+/*
+ * A directory "path" has been created (so is empty): start its totals
+ * and count it in those of its parent.
+ */
+void
+dirsum_mkdir(const struct sys *sys, const char *parent, const char *path)
+{
+	int		 sfd;
+	struct dirsum	 ds;
+
+	if ((sfd = dirsum_dir(sys)) == -1)
+		return;
+	memset(&ds, 0, sizeof(struct dirsum));
+	ds.stamp = time(NULL);
+	dirsum_put(sys, sfd, path, &ds);
+	close(sfd);
+	dirsum_adjust(sys, parent, 0, 0, 1);
+}
+
+/*
+ * The (empty) directory "path" has been removed: drop its totals and
+ * uncount it from those of its parent.
+ */
+void
+dirsum_rmdir(const struct sys *sys, const char *parent, const char *path)
+{
+	int	 sfd;
+	char	 name[SHA256_DIGEST_STRING_LENGTH];
+
+	if ((sfd = dirsum_dir(sys)) == -1)
+		return;
+	dirsum_name(path, name);
+	if (unlinkat(sfd, name, 0) == -1 && errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: unlinkat", SUMDIR, name);
+	close(sfd);
+	dirsum_adjust(sys, parent, 0, 0, -1);
+}
+
+/*
+ * The size of the counted file "name" in "dfd", or -1 if there's no
+ * such file.
+ * Call before replacing a file, then pass to dirsum_file().
+ */
+int64_t
+dirsum_fsize(int dfd, const char *name)
+{
+	struct stat	 st;
+
+	if (name[0] == '.' ||
+	    fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    ! S_ISREG(st.st_mode))
+		return -1;
+	return st.st_size;
+}
+
+/*
+ * The file "name" in "dfd", the directory of the request, has been
+ * written over whatever was there before, which had the size "prev"
+ * from dirsum_fsize().
+ */
+void
+dirsum_file(const struct sys *sys, int dfd, const char *name, int64_t prev)
+{
+	int64_t	 size;
+
+	if ((size = dirsum_fsize(dfd, name)) == -1)
+		return;
+	if (prev == -1)
+		dirsum_adjust(sys, sys->resource, size, 1, 0);
+	else if (size != prev)
+		dirsum_adjust(sys, sys->resource, size - prev, 0, 0);
+}
+
+/*
+ * Total the directory "dfd" (closed on return) at "path", of length
+ * "len" in a buffer of PATH_MAX, and its subdirectories, writing the
+ * totals of each as we go.
+ * Abandoned staging files are removed on the way (see stage_reap()).
+ * Returns zero if the directory couldn't be read.
+ */
+static int
+dirsum_walk(const struct sys *sys, int sfd, int dfd,
+	char *path, size_t len, size_t depth, struct dirsum *ds)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	struct dirsum	 sub;
+	int		 fd, sz;
+
+	memset(ds, 0, sizeof(struct dirsum));
+	ds->stamp = time(NULL);
+
+	if ((dir = fdopendir(dfd)) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s: fdopendir", path);
+		close(dfd);
+		return 0;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(dir), dp->d_name,
+		    &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if (S_ISREG(st.st_mode) && dp->d_name[0] != '.') {
+			ds->bytes += st.st_size;
+			ds->files++;
+			continue;
+		} else if (S_ISREG(st.st_mode)) {
+			stage_reap(sys, dirfd(dir),
+				path, dp->d_name, &st);
+			continue;
+		}
+		if ( ! S_ISDIR(st.st_mode) || depth >= DIRSUM_MAXDEPTH)
+			continue;
+
+		sz = snprintf(path + len, PATH_MAX - len, "%s%s",
+			len > 0 ? "/" : "", dp->d_name);
+		if (sz < 0 || (size_t)sz >= PATH_MAX - len) {
+			path[len] = '\0';
+			continue;
+		}
+		fd = openat(dirfd(dir), dp->d_name,
+			O_RDONLY|O_DIRECTORY|O_NOFOLLOW, 0);
+		if (fd != -1 && dirsum_walk(sys, sfd,
+		    fd, path, len + sz, depth + 1, &sub)) {
+			ds->bytes += sub.bytes;
+			ds->files += sub.files;
+			ds->dirs += sub.dirs + 1;
+		}
+		path[len] = '\0';
+	}
+
+	closedir(dir);
+	dirsum_put(sys, sfd, path, ds);
+	return 1;
+}
+
+/*
+ * Rebuild the totals of the directory "path" and everything under it
+ * in the background (see detach()).
+ * Only one rebuild runs at a time: others are simply dropped, as the
+ * next request for a stale directory will ask again.
+ */
+void
+dirsum_rebuild(const struct sys *sys, const char *path)
+{
+	int		 sfd, lfd, dfd;
+	struct dirsum	 ds;
+	char		 buf[PATH_MAX];
+
+	if (strlcpy(buf, path, sizeof(buf)) >= sizeof(buf) || detach(sys))
+		return;
+
+	if ((sfd = dirsum_dir(sys)) == -1)
+		_exit(EXIT_FAILURE);
+	lfd = openat(sfd, DIRSUM_LOCK, O_RDWR|O_CREAT, 0600);
+	if (lfd == -1 || flock(lfd, LOCK_EX|LOCK_NB) == -1)
+		_exit(EXIT_SUCCESS);
+
+	dfd = buf[0] == '\0' ? dup(sys->filefd) :
+		openat(sys->filefd, buf,
+			O_RDONLY|O_DIRECTORY|O_NOFOLLOW, 0);
+	if (dfd == -1) {
+		kutil_warn(&sys->req, sys->curuser, "%s", buf);
+		_exit(EXIT_FAILURE);
+	}
+	if (dirsum_walk(sys, sfd, dfd, buf, strlen(buf), 0, &ds))
+		kutil_info(&sys->req, sys->curuser,
+			"%s: totals rebuilt: %" PRId64 " files, %"
+			PRId64 " bytes", buf, ds.files, ds.bytes);
+	_exit(EXIT_SUCCESS);
+}
@@ -26,13 +26,42 @@
 
 #define FILEDIR CACHEDIR "/files"
 #define AUTHDIR CACHEDIR "/cookies"
+#define GZIPDIR CACHEDIR "/gzip"
+#define UPLOADDIR CACHEDIR "/uploads"
+#define BLOBDIR CACHEDIR "/blobs"
+#define LISTDIR CACHEDIR "/listings"
+#define SUMDIR CACHEDIR "/sums"
+#define SEARCHDIR CACHEDIR "/search"
 
-/* Temporary directory. */
+/* Size of all but the last chunk of a chunked upload. */
 
-#if 0
-# ifndef TMPDIR
-#  define TMPDIR "/tmp"
-# endif
+#define UPLOAD_CHUNKSZ (4 * 1024 * 1024)
+
+/* Largest chunked upload. */
+
+#ifndef UPLOAD_MAXSZ
+# define UPLOAD_MAXSZ (INT64_C(16) * 1024 * 1024 * 1024)
+#endif
+
+/*
+ * Seconds an upload (a chunked session, or a staging file left by one
+ * that was cut off) may sit idle before it's removed.
+ */
+
+#ifndef UPLOAD_MAXAGE
+# define UPLOAD_MAXAGE (24 * 60 * 60)
+#endif
+
+/*
+ * Maximum number of files of one upload written (or, when streamed,
+ * published) at once.
+ */
+
+#ifndef WRITEJOBS
+# define WRITEJOBS 4
+#endif
+#if WRITEJOBS < 1
+# error "WRITEJOBS must be at least 1"
 #endif
 
 /*
@@ -44,14 +73,12 @@
 struct	sys {
 	int		 filefd; /* directory handle */
 	int		 authfd; /* directory handle */
-#if 0
-	int		 tmpfd; /* directory handle */
-#endif
 	const char	*resource; /* requested resource */
 	struct kreq	 req; /* request */
 	int		 loggedin; /* logged in? */
 	const char	*curuser; /* if logged in (or NULL) */
 	int64_t		 curcookie; /* user cookie (if logged in) */
+	int64_t		 upload; /* streamed upload length or -1 */
 };
 
 /*
@@ -66,6 +93,95 @@ struct	user {
 
 TAILQ_HEAD(userq, user);
 
+/*
+ * What a directory listing needs of an entry's status.
+ * This is a fraction of a "struct stat" and is stored as-is in cached
+ * listings.
+ */
+struct	fattr {
+	int64_t		 size; /* file size */
+	int64_t		 ctime; /* status change time */
+	int64_t		 mtime; /* modification time */
+	uint32_t	 mode; /* type and permissions */
+	uint32_t	 uid; /* owner */
+	uint32_t	 gid; /* group */
+};
+
+/*
+ * A directory listing being cached (see dircache_create()), and the
+ * callback for each entry of a cached listing.
+ */
+struct	dircache;
+
+typedef void	(*dircache_fn)(const char *, const struct fattr *, void *);
+
+/*
+ * The callback for each path found by search_find().
+ */
+typedef void	(*search_fn)(const char *, void *);
+
+/*
+ * Recursive totals of a directory's subtree (see dirsum_get()).
+ */
+struct	dirsum {
+	int64_t		 bytes; /* size of all files */
+	int64_t		 files; /* number of files */
+	int64_t		 dirs; /* number of directories */
+	int64_t		 stamp; /* when last walked */
+};
+
+/*
+ * A change to a directory's entries (see dircache_begin()).
+ */
+struct	dirtx;
+
+/*
+ * A file being published into the directory of the request (see
+ * stage_begin()).
+ */
+struct	stage {
+	int64_t		 prev; /* size of file replaced or -1 */
+	int		 fd; /* file replaced or -1 */
+	struct dirtx	*tx; /* change to directory */
+};
+
+/*
+ * A page template compiled into the binary by mktemplates: its text
+ * without the @@KEY@@s, split into runs each followed by a key.
+ */
+struct	tmplseg {
+	size_t		 off; /* offset of run in text */
+	size_t		 sz; /* length of run */
+	const char	*key; /* following key or NULL */
+};
+
+struct	tmplbin {
+	const char		*name; /* file name in DATADIR */
+	const char		*text; /* text without keys */
+	const struct tmplseg	*segs; /* runs of text */
+	size_t			 segsz; /* number of runs */
+};
+
+/*
+ * A page template ready to be filled in (see tmpl_open()).
+ */
+struct	tmpl {
+	const struct tmplbin *bin; /* compiled in or NULL */
+	int		 fd; /* otherwise, file or -1 */
+	char		*fn; /* file name */
+};
+
+/*
+ * A resumable, chunked upload in progress.
+ * It's staged in UPLOADDIR until all chunks are in.
+ */
+struct	upsess {
+	char		 id[17]; /* session identifier */
+	char		*file; /* target file name */
+	int64_t		 size; /* total size */
+	size_t		 chunks; /* number of chunks */
+};
+
 /*
  * Holds all information required for working with the file-based
  * authentication database: htpasswd(1).
@@ -88,6 +204,91 @@ int		 auth_file_chpass(const struct sys *,
 int64_t		 auth_file_login(const struct sys *, const struct auth *,
 			const char *, const char *);
 
+int		 detach(const struct sys *);
+
+int		 dedup_hash_fd(int, char *);
+int		 dedup_link(const struct sys *, int,
+			const char *, const char *, int64_t);
+int		 dedup_publish(const struct sys *, int,
+			const char *, int, const char *, const char *);
+void		 dedup_replaced(const struct sys *, int, const char *);
+void		 dedup_unref(const struct sys *, int,
+			const char *, const struct stat *);
+
+void		 dircache_add(struct dircache *,
+			const char *, const struct fattr *);
+struct dirtx	*dircache_begin(const struct sys *, int, const char *);
+void		 dircache_commit(struct dirtx *, const char *);
+struct dircache	*dircache_create(const struct sys *, const struct stat *);
+void		 dircache_discard(struct dircache *);
+void		 dircache_finish(struct dircache *);
+int		 dircache_load(const struct sys *, const struct stat *,
+			dircache_fn, void *);
+void		 dirsum_adjust(const struct sys *, const char *,
+			int64_t, int64_t, int64_t);
+void		 dirsum_file(const struct sys *, int,
+			const char *, int64_t);
+int64_t		 dirsum_fsize(int, const char *);
+int		 dirsum_get(const struct sys *,
+			const char *, struct dirsum *);
+void		 dirsum_mkdir(const struct sys *,
+			const char *, const char *);
+void		 dirsum_rebuild(const struct sys *, const char *);
+void		 dirsum_rmdir(const struct sys *,
+			const char *, const char *);
+int		 dirsum_stale(const struct dirsum *, int);
+
+void		 fattr_stat(struct fattr *, const struct stat *);
+
+void		 gzip_remove(const struct sys *, const struct stat *);
+
+void		 search_add(const struct sys *, const char *,
+			const char *, int);
+int		 search_find(const struct sys *, const char *,
+			const char *, size_t, search_fn, void *);
+void		 search_rebuild(const struct sys *);
+void		 search_remove(const struct sys *, const char *,
+			const char *, int);
+
+int		 stage_close(const struct sys *, int, int,
+			const char *, const char *, int, const char *);
+void		 stage_begin(const struct sys *, int,
+			const char *, struct stage *);
+void		 stage_done(const struct sys *, int,
+			const char *, struct stage *, int);
+int		 stage_open(const struct sys *, int,
+			const char *, char *, size_t);
+void		 stage_reap(const struct sys *, int, const char *,
+			const char *, const struct stat *);
+
+int64_t		 upload_stream_init(void);
+int		 upload_stream(const struct sys *, int,
+			int64_t, const char *);
+
+int		 tar_stream(const struct sys *, int, const char *);
+
+void		 tmpl_close(struct tmpl *);
+int		 tmpl_open(const struct sys *, const char *, struct tmpl *);
+int		 tmpl_write(struct sys *, const struct tmpl *,
+			const struct ktemplate *);
+
+int		 upsess_commit(const struct sys *, int,
+			const struct upsess *, int);
+int		 upsess_create(const struct sys *, int,
+			const char *, int64_t, struct upsess *);
+void		 upsess_free(struct upsess *);
+char		*upsess_have(const struct sys *, int,
+			const struct upsess *);
+int		 upsess_open(const struct sys *, int,
+			const char *, struct upsess *);
+void		 upsess_remove(const struct sys *, int, const char *);
+int		 upsess_write(const struct sys *, int,
+			const struct upsess *, size_t, const char *, size_t);
+
+int		 zip_stream(const struct sys *, int);
+
+extern const struct tmplbin tmplbins[];
+
 __END_DECLS
 
 #endif /* ! EXTERN_H */
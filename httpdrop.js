@@ -53,6 +53,238 @@
 		return false;
 	}
 
+	/*
+	 * Post the fields of the object "fields" to "url" as form data.
+	 * Call "done" with the parsed JSON response (or an empty object)
+	 * on success, or with null on any failure.
+	 */
+	function post(url, fields, done)
+	{
+		var xmh = new XMLHttpRequest();
+		var data = new FormData();
+
+		for (var key in fields)
+			if (fields.hasOwnProperty(key)) {
+				if (fields[key] instanceof Blob)
+					data.append(key, fields[key], 'chunk');
+				else
+					data.append(key, fields[key]);
+			}
+
+		xmh.open('POST', url, true);
+		xmh.onreadystatechange = function() {
+			var res = {};
+			if (xmh.readyState !== 4)
+				return;
+			if (xmh.status !== 200) {
+				done(null);
+				return;
+			}
+			try {
+				if (xmh.responseText.length)
+					res = JSON.parse(xmh.responseText);
+			} catch (e) {
+				res = null;
+			}
+			done(res);
+		};
+		xmh.send(data);
+	}
+
+	/*
+	 * Maximum number of chunks in flight at once and the number of
+	 * times to retry each before giving up.
+	 */
+	var chunkParallel = 4;
+	var chunkRetries = 5;
+
+	/*
+	 * Upload the file "file" to "url" in chunks, resuming an earlier
+	 * upload of the same file if we remember one.
+	 * Reports completed bytes with "prog" and calls "done" with true
+	 * on success or false on failure.
+	 * On failure, the session is kept so the upload may be resumed.
+	 */
+	function uploadFile(url, file, prog, done)
+	{
+		var key = 'httpdrop-upload:' + url + ':' + file.name +
+			':' + file.size + ':' + file.lastModified;
+		var id = null, store = null;
+
+		try {
+			store = window.localStorage;
+		} catch (e) {
+			store = null;
+		}
+
+		function commit()
+		{
+			post(url, { op: 'mkfile', step: 'commit', upid: id },
+			    function(res) {
+				if (res !== null && store !== null)
+					store.removeItem(key);
+				done(res !== null);
+			});
+		}
+
+		function send(sess)
+		{
+			var queue = [], sent = 0, active = 0, failed = false;
+			var i, have = sess.have || '';
+
+			for (i = 0; i < sess.chunks; i++)
+				if (have.charAt(i) === '1')
+					sent += Math.min(sess.chunk,
+						sess.size - i * sess.chunk);
+				else
+					queue.push(i);
+
+			prog(sent);
+
+			function next()
+			{
+				var n, tries = 0;
+
+				if (failed)
+					return;
+				if (queue.length === 0) {
+					if (active === 0)
+						commit();
+					return;
+				}
+
+				n = queue.shift();
+				active++;
+
+				function attempt()
+				{
+					var start = n * sess.chunk;
+					var end = Math.min(start +
+						sess.chunk, sess.size);
+
+					if (failed)
+						return;
+					post(url, {
+						op: 'mkfile',
+						step: 'chunk',
+						upid: id,
+						chunk: n,
+						file: file.slice(start, end)
+					}, function(res) {
+						if (failed)
+							return;
+						if (res === null &&
+						    ++tries < chunkRetries) {
+							setTimeout(attempt,
+								1000 * tries);
+							return;
+						} else if (res === null) {
+							failed = true;
+							done(false);
+							return;
+						}
+						active--;
+						sent += end - start;
+						prog(sent);
+						next();
+					});
+				}
+
+				attempt();
+			}
+
+			for (i = 0; i < chunkParallel; i++)
+				next();
+		}
+
+		function create()
+		{
+			post(url, {
+				op: 'mkfile',
+				step: 'init',
+				filename: file.name,
+				size: file.size
+			}, function(res) {
+				if (res === null) {
+					done(false);
+					return;
+				}
+				id = res.id;
+				if (store !== null)
+					store.setItem(key, id);
+				send(res);
+			});
+		}
+
+		if (store !== null)
+			id = store.getItem(key);
+
+		if (id === null) {
+			create();
+			return;
+		}
+
+		post(url, { op: 'mkfile', step: 'status', upid: id },
+		    function(res) {
+			if (res === null) {
+				store.removeItem(key);
+				create();
+			} else
+				send(res);
+		});
+	}
+
+	/*
+	 * Upload all files selected in the form "e" one after another in
+	 * resumable chunks.
+	 * The callbacks are as for sendForm().
+	 */
+	function sendChunks(e, setup, error, success, prog)
+	{
+		var input = find('file-name-input');
+		var url = e.action.split('?')[0];
+		var files, total = 0, done = 0, i = 0;
+
+		if (input === null || input.files.length === 0)
+			return sendForm(e, setup, error, success, prog);
+
+		files = input.files;
+		for (var j = 0; j < files.length; j++)
+			total += files[j].size;
+
+		if (setup !== null)
+			setup(e);
+
+		function next()
+		{
+			var file;
+
+			if (i === files.length) {
+				if (success !== null)
+					success();
+				return;
+			}
+
+			file = files[i++];
+			uploadFile(url, file, function(sent) {
+				if (prog !== null && total > 0)
+					prog(Math.round(((done + sent) *
+						100) / total));
+			}, function(ok) {
+				if (!ok) {
+					if (error !== null)
+						error();
+					return;
+				}
+				done += file.size;
+				next();
+			});
+		}
+
+		next();
+		return false;
+	}
+
 	function initFileName()
 	{
 		var file, e;
@@ -149,7 +381,7 @@
 
 		if ((formUploader = find('file-uploader')) !== null)
 			formUploader.onsubmit = function() {
-				return sendForm(formUploader,
+				return sendChunks(formUploader,
 					initUploaderSetup,
 					initUploaderError,
 					initUploaderFinish,
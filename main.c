@@ -19,11 +19,16 @@
 #include <sys/stat.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sha2.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,12 +37,52 @@
 
 #include <kcgi.h>
 #include <kcgihtml.h>
-#if 0
-# include <zip.h>
-#endif
+#include <kcgijson.h>
+#include <zlib.h>
 
 #include "extern.h"
 
+/* Maximum number of byte ranges honoured in one request. */
+
+#define	RANGE_MAX 32
+
+/* Read size when streaming files to the client. */
+
+#define	STREAM_BUFSZ (256 * 1024)
+
+/*
+ * If OFFLOAD_HEADER is defined (e.g., "X-Sendfile"), regular files are
+ * handed to the front-end web server to send by way of this response
+ * header.
+ * Its value is the file's path under OFFLOAD_PREFIX, which must be
+ * given as the front-end sees it: there's no sensible default, as it
+ * may run in a different root than we do.
+ * It's an internal URI prefix (e.g., "/files" with "X-Accel-Redirect")
+ * and the path is URL-encoded, unless OFFLOAD_PATH is also defined:
+ * then it's a file-system path and the path is sent as-is.
+ */
+
+#if defined(OFFLOAD_HEADER) && !defined(OFFLOAD_PREFIX)
+# error "OFFLOAD_HEADER requires OFFLOAD_PREFIX"
+#endif
+
+/* Default and largest number of entries on one listing page. */
+
+#define	LIST_PAGESZ 500
+#define	LIST_PAGEMAX 5000
+
+/* Entries sorted and sent at once when streaming a whole listing. */
+
+#define	LIST_CHUNK 64
+
+/* Value bits of a listing sort key, below its type bits. */
+
+#define	LISTKEY_VAL ((UINT64_C(1) << 62) - 1)
+
+/* Smallest file worth compressing for the client. */
+
+#define	GZIP_MINSZ 1024
+
 /* We have only one "real" page. */
 
 enum	page {
@@ -48,15 +93,15 @@ enum	page {
 enum	action {
 	ACTION_CHPASS,
 	ACTION_GET,
-#if 0
+	ACTION_GETTAR,
 	ACTION_GETZIP,
-#endif
 	ACTION_LOGIN,
 	ACTION_LOGOUT,
 	ACTION_MKDIR,
 	ACTION_MKFILE,
 	ACTION_RMDIR,
 	ACTION_RMFILE,
+	ACTION_SEARCH,
 	ACTION__MAX
 };
 
@@ -70,6 +115,17 @@ enum	key {
 	KEY_SESSCOOKIE,
 	KEY_SESSUSER,
 	KEY_USER,
+	KEY_CHUNK,
+	KEY_SIZE,
+	KEY_STEP,
+	KEY_UPID,
+	KEY_AFTER,
+	KEY_BEFORE,
+	KEY_COUNT,
+	KEY_FORMAT,
+	KEY_ORDER,
+	KEY_QUERY,
+	KEY_SORT,
 	KEY__MAX
 };
 
@@ -79,6 +135,7 @@ enum	templ {
 	TEMPL_USER,
 	TEMPL_MESSAGE,
 	TEMPL_FILES,
+	TEMPL_PAGER,
 	TEMPL__MAX
 };
 
@@ -96,12 +153,12 @@ enum	loginerr {
 };
 
 /*
- * A file reference used for listing directory contents.
+ * A byte range requested of a regular file.
+ * Both offsets are inclusive and within the file.
  */
-struct	fref {
-	char		*name; /* name of file in path */
-	char		*fullname; /* fullname of file */
-	struct stat	 st; /* last known stat */
+struct	range {
+	off_t		 start; /* first byte */
+	off_t		 end; /* last byte */
 };
 
 /*
@@ -112,17 +169,82 @@ struct	loginpage {
 	struct sys	*sys;
 };
 
+/*
+ * Orders of a directory listing, each either ascending or descending.
+ * Directories always come before files.
+ */
+enum	listsort {
+	LISTSORT_NAME, /* by name */
+	LISTSORT_SIZE, /* by size (files), then name */
+	LISTSORT_MTIME, /* by modification time, then name */
+	LISTSORT__MAX
+};
+
+/*
+ * A file reference used for listing directory contents.
+ * These are the preallocated slots of a page, so the name is inline.
+ */
+struct	fref {
+	uint64_t	 key; /* sort key (see listsel_key()) */
+	struct fattr	 attr; /* status */
+	char		 name[NAME_MAX + 1]; /* name of file in path */
+};
+
+/*
+ * A page slot's sort key while the page is being sorted.
+ */
+struct	listkey {
+	uint64_t	 key; /* sort key */
+	const char	*name; /* name, for equal keys */
+	size_t		 slot; /* index into "frefs" */
+};
+
+/*
+ * Selects one page of a directory listing as its entries stream by:
+ * the "max" entries nearest after (or, if "back", before) the cursor,
+ * in listing order.
+ * The page is kept in a bounded heap (of indices into "frefs") whose
+ * root is the entry farthest from the cursor, so memory doesn't grow
+ * with the directory and nothing is allocated per entry.
+ * Entries are compared by their packed sort keys, and by name only
+ * when those are equal.
+ */
+struct	listsel {
+	struct fref	*frefs; /* page slots */
+	size_t		*heap; /* slots as a heap */
+	size_t		 heapsz; /* entries in heap */
+	size_t		 max; /* page size */
+	struct listkey	*keys; /* for sorting the page */
+	struct listkey	*keytmp; /* for sorting the page */
+	enum listsort	 sort; /* listing order */
+	int		 desc; /* order is descending */
+	const char	*cur; /* cursor name or NULL */
+	uint64_t	 curkey; /* cursor sort key */
+	int		 back; /* select before cursor */
+	int		 noparent; /* don't select ".." */
+	size_t		 inside; /* entries past the cursor */
+	size_t		 outside; /* entries not past the cursor */
+	size_t		 filesz; /* non-.. file/dir count */
+	size_t		 rfilesz; /* regular file count */
+};
+
 /*
  * Used for regular directory page listing template.
+ * The listing may be scanned while the page is being sent, after the
+ * page head has gone out: see get_dir_files().
  */
 struct	dirpage {
-	struct fref	*frefs; /* file references */
-	size_t		 frefsz; /* all file count */
 	size_t		 filesz; /* non-.. file/dir count */
 	size_t		 rfilesz; /* regular file count */
 	int		 rdwr; /* is read-writable? */
 	int		 root; /* is document root? */
 	const char	*fpath; /* request path w/script name */
+	struct listsel	*sel; /* page selection */
+	DIR		*dir; /* directory still to scan or NULL */
+	struct dircache	*dc; /* listing being cached or NULL */
+	int		 chunked; /* send all entries as scanned */
+	size_t		 rows; /* rows sent */
+	struct khtmlreq	*req; /* while sending rows */
 	struct sys	*sys;
 };
 
@@ -148,6 +270,23 @@ static const struct kvalid keys[KEY__MAX] = {
 	{ kvalid_int, "stok" }, /* KEY_SESSCOOKIE */
 	{ kvalid_stringne, "suser" }, /* KEY_SESSUSER */
 	{ kvalid_stringne, "user" }, /* KEY_USER */
+	{ kvalid_uint, "chunk" }, /* KEY_CHUNK */
+	{ kvalid_uint, "size" }, /* KEY_SIZE */
+	{ kvalid_stringne, "step" }, /* KEY_STEP */
+	{ kvalid_stringne, "upid" }, /* KEY_UPID */
+	{ kvalid_stringne, "after" }, /* KEY_AFTER */
+	{ kvalid_stringne, "before" }, /* KEY_BEFORE */
+	{ kvalid_uint, "count" }, /* KEY_COUNT */
+	{ kvalid_stringne, "format" }, /* KEY_FORMAT */
+	{ kvalid_stringne, "order" }, /* KEY_ORDER */
+	{ kvalid_stringne, "q" }, /* KEY_QUERY */
+	{ kvalid_stringne, "sort" }, /* KEY_SORT */
+};
+
+static const char *const listsorts[LISTSORT__MAX] = {
+	"name", /* LISTSORT_NAME */
+	"size", /* LISTSORT_SIZE */
+	"mtime", /* LISTSORT_MTIME */
 };
 
 static const char *const templs[TEMPL__MAX] = {
@@ -156,31 +295,113 @@ static const char *const templs[TEMPL__MAX] = {
 	"USER", /* TEMPL_USER */
 	"MESSAGE", /* TEMPL_MESSAGE */
 	"FILES", /* TEMPL_FILES */
+	"PAGER", /* TEMPL_PAGER */
 };
 
 static void
 errorpage(struct sys *, const char *, ...)
 	__attribute__((format(printf, 2, 3)));
+static int
+open_dir(struct sys *, const char *);
 
 /*
- * Fill out all HTTP secure headers.
- * Use the existing document's MIME type.
- * Then emit the body indicator.
+ * See if the client accepts the gzip content coding, i.e., it's listed
+ * (or matched by a wildcard) and not given a zero quality.
+ */
+static int
+http_accept_gzip(const struct kreq *r)
+{
+	const char	*cp, *end, *q;
+	size_t		 sz;
+
+	if (r->reqmap[KREQU_ACCEPT_ENCODING] == NULL)
+		return 0;
+
+	for (cp = r->reqmap[KREQU_ACCEPT_ENCODING]->val;
+	     *cp != '\0'; cp = end) {
+		while (isspace((unsigned char)*cp) || *cp == ',')
+			cp++;
+		if (*cp == '\0')
+			break;
+		if ((end = strchr(cp, ',')) == NULL)
+			end = cp + strlen(cp);
+		sz = strcspn(cp, " \t;,");
+		if ( ! (sz == 4 && strncasecmp(cp, "gzip", 4) == 0) &&
+		    ! (sz == 6 && strncasecmp(cp, "x-gzip", 6) == 0) &&
+		    ! (sz == 1 && *cp == '*'))
+			continue;
+		if ((q = memchr(cp, ';', end - cp)) != NULL) {
+			for (q++; isspace((unsigned char)*q); q++)
+				continue;
+			if (strncasecmp(q, "q=", 2) == 0 &&
+			    strtod(q + 2, NULL) <= 0.0)
+				return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a MIME type is textual enough to be worth compressing.
+ */
+static int
+mime_compressible(const char *type)
+{
+
+	return strncmp(type, "text/", 5) == 0 ||
+		strstr(type, "json") != NULL ||
+		strstr(type, "xml") != NULL ||
+		strstr(type, "javascript") != NULL;
+}
+
+/*
+ * Fill out the status and all HTTP secure headers with an explicit
+ * content type "type".
+ * Does not emit the body indicator.
  */
 static void
-http_open_mime(struct kreq *r, enum khttp code, enum kmime mime)
+http_head_type(struct kreq *r, enum khttp code, const char *type)
 {
 
 	khttp_head(r, kresps[KRESP_STATUS],
 		"%s", khttps[code]);
-	if (KMIME__MAX == mime)
-		mime = KMIME_APP_OCTET_STREAM;
 	khttp_head(r, kresps[KRESP_CONTENT_TYPE],
-		"%s", kmimetypes[mime]);
+		"%s", type);
 	khttp_head(r, "X-Content-Type-Options", "nosniff");
 	khttp_head(r, "X-Frame-Options", "DENY");
 	khttp_head(r, "X-XSS-Protection", "1; mode=block");
-	khttp_body(r);
+}
+
+/*
+ * Fill out all HTTP secure headers with the MIME type "mime".
+ * Then emit the body indicator.
+ */
+static void
+http_open_mime(struct kreq *r, enum khttp code, enum kmime mime)
+{
+	int	 gz = 0;
+
+	if (KMIME__MAX == mime)
+		mime = KMIME_APP_OCTET_STREAM;
+	http_head_type(r, code, kmimetypes[mime]);
+
+	/*
+	 * Pages (listings, JSON) are compressed by kcgi as they're
+	 * sent, but only if we agree the client accepts gzip: kcgi's
+	 * own check ignores a zero quality.
+	 * Other responses have no body worth compressing, and a 304
+	 * must have none at all.
+	 */
+
+#ifndef NOGZIP
+	if (code == KHTTP_200 && mime_compressible(kmimetypes[mime])) {
+		khttp_head(r, kresps[KRESP_VARY], "Accept-Encoding");
+		gz = http_accept_gzip(r);
+	}
+#endif
+	khttp_body_compress(r, gz);
 }
 
 /*
@@ -193,112 +414,195 @@ http_open(struct kreq *r, enum khttp code)
 	http_open_mime(r, code, (enum kmime)r->mime);
 }
 
-#if 0
 /*
- * Creates a zip file of the directory contents in "nfd".
+ * The MIME type of the requested document, defaulting to binary.
  */
-static char *
-zip_create(struct sys *sys, int nfd)
+static const char *
+http_mime(const struct kreq *r)
 {
-	int	 	 nnfd, fd, erp;
-	zip_error_t	 zer;
-	char		*ret = NULL, *path = NULL;
-	zip_t		*zip = NULL;
-	DIR		*dir = NULL;
-	FILE		*f;
-	zip_source_t	*src;
-	struct dirent	*dp;
 
-	kasprintf(&path, "%s/%s/httpdrop.XXXXXXXXXX",
-		CACHEDIR, TMPDIR);
+	return r->mime < KMIME__MAX ? kmimetypes[r->mime] :
+		kmimetypes[KMIME_APP_OCTET_STREAM];
+}
 
-	if (NULL == mktemp(path)) {
-		kutil_warn(&sys->req, sys->curuser, "mktemp");
-		return(NULL);
-	}
+/*
+ * Format the strong entity tag of a regular file into "buf".
+ * This changes whenever the file is replaced or modified.
+ * The gzip encoding, if "gz" is set, is a distinct representation and
+ * gets a distinct tag.
+ */
+static void
+etag_file(const struct stat *st, int gz, char *buf, size_t sz)
+{
 
-	zip = zip_open(path, ZIP_CREATE | ZIP_EXCL, &erp);
+	snprintf(buf, sz, "\"%jx-%jx-%jx.%lx%s\"",
+		(uintmax_t)st->st_ino, (uintmax_t)st->st_size,
+		(uintmax_t)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		gz ? "-gz" : "");
+}
 
-	if (NULL == zip) {
-		zip_error_init_with_code(&zer, erp);
-		kutil_warnx(&sys->req, sys->curuser,
-			"%s: %s", path, zip_error_strerror(&zer));
-		zip_error_fini(&zer);
-		goto out;
-	}
+/*
+ * Format the weak entity tag of a directory listing into "buf".
+ * The listing depends not only on the directory, but on who's looking
+ * at it, whether it's writable, and whether it's JSON, so mix those in
+ * as well.
+ * Changes below the directory don't touch its mtime, but do change its
+ * totals "ds", as they do those of the subdirectories listed.
+ */
+static void
+etag_dir(const struct sys *sys, const struct stat *st,
+	const struct dirsum *ds, int rdwr, int json, char *buf, size_t sz)
+{
+	uint32_t	 h = 2166136261U;
+	const char	*cp;
+	const unsigned char *up;
+	size_t		 i;
 
-	/*
-	 * Iterate through regular non-dot files in nfd.
-	 * We make a copy of nfd because fdopendir() will swallow the
-	 * descriptor and close it on closedir().
-	 */
+	/* FNV-1a of the user name and totals. */
 
-	if (-1 == (nnfd = dup(nfd))) {
-		kutil_warn(&sys->req, sys->curuser, "dup");
-		goto out;
-	} else if (NULL == (dir = fdopendir(nnfd))) {
-		kutil_warn(&sys->req, sys->curuser, "%s/%s: "
-			"fdopendir", FILEDIR, sys->resource);
-		close(nnfd);
-		goto out;
-	}
+	if (sys->curuser != NULL)
+		for (cp = sys->curuser; *cp != '\0'; cp++)
+			h = (h ^ (unsigned char)*cp) * 16777619U;
+	for (up = (const unsigned char *)ds, i = 0;
+	     i < offsetof(struct dirsum, stamp); i++)
+		h = (h ^ up[i]) * 16777619U;
 
-	while (NULL != (dp = readdir(dir))) {
-		if (DT_REG != dp->d_type || '.' == dp->d_name[0])
-			continue;
+	snprintf(buf, sz, "W/\"%jx-%jx.%lx-%d%s-%" PRIx32 "\"",
+		(uintmax_t)st->st_ino, (uintmax_t)st->st_mtim.tv_sec,
+		st->st_mtim.tv_nsec, rdwr, json ? "j" : "", h);
+}
 
-		fd = openat(nfd, dp->d_name, O_RDONLY, 0);
-		if (-1 == fd) {
-			kutil_warn(&sys->req, sys->curuser,
-				"%s/%s/%s: openat", FILEDIR,
-				sys->resource, dp->d_name);
-			goto out;
-		} else if (NULL == (f = fdopen(fd, "r"))) {
-			kutil_warn(&sys->req, sys->curuser,
-				"%s/%s/%s: fdopen", FILEDIR,
-				sys->resource, dp->d_name);
-			close(fd);
-			goto out;
-		}
+/*
+ * Parse an RFC 7231 IMF-fixdate, e.g., "Sun, 06 Nov 1994 08:49:37 GMT".
+ * Returns zero if the date could not be parsed.
+ */
+static int
+http_date2epoch(const char *date, time_t *t)
+{
+	struct tm	 tm;
+	const char	*cp;
 
-		/* Open ZIP source (transfers stream ownership). */
+	memset(&tm, 0, sizeof(struct tm));
+	cp = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (cp == NULL || *cp != '\0')
+		return 0;
+	*t = timegm(&tm);
+	return *t != -1;
+}
 
-		src = zip_source_filep_create(f, 0, -1, &zer);
-		if (NULL == src) {
-			kutil_warnx(&sys->req, sys->curuser, "%s: "
-				"%s", path, zip_error_strerror(&zer));
-			fclose(f);
-			goto out;
-		} else if (zip_file_add(zip, dp->d_name, src, 0) < 0) {
-			kutil_warnx(&sys->req, sys->curuser,
-				"%s: %s", path, zip_strerror(zip));
-			zip_source_free(src);
-			goto out;
+/*
+ * See if the entity tag "etag" is in the comma-separated list "list".
+ * If "strong" is set, weak tags never match; otherwise, the weakness
+ * indicator is ignored on both sides.
+ */
+static int
+etag_match(const char *list, const char *etag, int strong)
+{
+	const char	*cp, *end, *ep;
+	size_t		 sz;
+
+	if (strncmp(etag, "W/", 2) == 0) {
+		if (strong)
+			return 0;
+		etag += 2;
+	}
+	sz = strlen(etag);
+
+	for (cp = list; *cp != '\0'; cp = end) {
+		while (isspace((unsigned char)*cp) || *cp == ',')
+			cp++;
+		if (*cp == '\0')
+			break;
+		if ((end = strchr(cp, ',')) == NULL)
+			end = cp + strlen(cp);
+		if (*cp == '*')
+			return 1;
+		if (strncmp(cp, "W/", 2) == 0) {
+			if (strong)
+				continue;
+			cp += 2;
 		}
+		for (ep = end; ep > cp && isspace((unsigned char)ep[-1]); )
+			ep--;
+		if ((size_t)(ep - cp) == sz &&
+		    strncmp(cp, etag, sz) == 0)
+			return 1;
 	}
 
-	/* Close directory and ZIP archive file. */
+	return 0;
+}
 
-	closedir(dir);
-	dir = NULL;
-	if ((erp = zip_close(zip)) < 0) {
-		kutil_warnx(&sys->req, sys->curuser,
-			"%s: %s", path, zip_strerror(zip));
-		goto out;
-	}
-	zip = NULL;
+/*
+ * Format the name of the compressed sidecar of the file "st" into
+ * "buf".
+ * Sidecars are keyed by device and inode, so they follow the file
+ * through renames and don't need a directory hierarchy.
+ */
+static void
+gzip_sidecar(const struct stat *st, char *buf, size_t sz)
+{
 
-	ret = path;
-	path = NULL;
-out:
-	if (NULL != dir)
-		closedir(dir);
-	if (NULL != zip)
-		zip_discard(zip);
+	snprintf(buf, sz, "%jx-%jx.gz",
+		(uintmax_t)st->st_dev, (uintmax_t)st->st_ino);
+}
+
+/*
+ * Remove the compressed sidecar, if any, of the file "st", which is
+ * gone or is being removed.
+ */
+void
+gzip_remove(const struct sys *sys, const struct stat *st)
+{
+	char	 name[64], *path;
+
+	gzip_sidecar(st, name, sizeof(name));
+	kasprintf(&path, "%s/%s", GZIPDIR, name);
+	if (unlink(path) == -1 && errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser, "%s", path);
 	free(path);
-	return(ret);
 }
-#endif
+
+/*
+ * Emit the cache validators for a resource.
+ * Content is behind our login, so keep it out of shared caches and
+ * always have the browser revalidate.
+ */
+static void
+http_head_cache(struct kreq *r, const char *etag, time_t mtime)
+{
+	char	 buf[64];
+
+	khttp_epoch2str(mtime, buf, sizeof(buf));
+	khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+	khttp_head(r, kresps[KRESP_LAST_MODIFIED], "%s", buf);
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "private, no-cache");
+}
+
+/*
+ * Check the request's conditional headers against our validators.
+ * Per RFC 7232, If-None-Match takes precedence over If-Modified-Since.
+ * If the client's copy is current, respond with 304 and return
+ * non-zero; otherwise, return zero and do nothing.
+ */
+static int
+http_not_modified(struct kreq *r, const char *etag, time_t mtime)
+{
+	const struct khead *h;
+	time_t		 t;
+
+	if ((h = r->reqmap[KREQU_IF_NONE_MATCH]) != NULL) {
+		if ( ! etag_match(h->val, etag, 0))
+			return 0;
+	} else if ((h = r->reqmap[KREQU_IF_MODIFIED_SINCE]) != NULL) {
+		if ( ! http_date2epoch(h->val, &t) || mtime > t)
+			return 0;
+	} else
+		return 0;
+
+	http_head_cache(r, etag, mtime);
+	http_open(r, KHTTP_304);
+	return 1;
+}
 
 /*
  * Fill in templates to the login page (PAGE_LOGIN).
@@ -349,13 +653,11 @@ loginpage(struct sys *sys, enum loginerr error)
 {
 	struct ktemplate t;
 	struct loginpage loginpage;
-	int		 fd;
-	const char	*fn = DATADIR "/loginpage.xml";
+	struct tmpl	 tp;
 
 	/* Load our template and enact sandbox. */
 
-	if ((fd = open(fn, O_RDONLY, 0)) == -1)
-		kutil_warn(&sys->req, sys->curuser, "%s", fn);
+	tmpl_open(sys, "loginpage.xml", &tp);
 	if (pledge("stdio", NULL) == -1)
 		kutil_err(&sys->req, sys->curuser, "plege");
 
@@ -369,10 +671,8 @@ loginpage(struct sys *sys, enum loginerr error)
 	t.cb = loginpage_template;
 
 	http_open_mime(&sys->req, KHTTP_200, KMIME_TEXT_HTML);
-	if (fd != -1) {
-		khttp_template_fd(&sys->req, &t, fd, fn);
-		close(fd);
-	}
+	tmpl_write(sys, &tp, &t);
+	tmpl_close(&tp);
 }
 
 /*
@@ -426,13 +726,12 @@ errorpage(struct sys *sys, const char *fmt, ...)
 	char		*buf;
 	va_list		 ap;
 	struct ktemplate t;
-	int		 fd;
-	const char	*fn = DATADIR "/errorpage.xml";
+	struct tmpl	 tp;
+	int		 rc;
 
-	/* Pre-open file descriptor so we can pledge. */
+	/* Pre-open template (if not compiled in) so we can pledge. */
 
-	if ((fd = open(fn, O_RDONLY, 0)) == -1)
-		kutil_warn(&sys->req, sys->curuser, "%s", fn);
+	rc = tmpl_open(sys, "errorpage.xml", &tp);
 	if (pledge("stdio", NULL) == -1)
 		kutil_err(&sys->req, sys->curuser, "pledge");
 
@@ -454,201 +753,851 @@ errorpage(struct sys *sys, const char *fmt, ...)
 
 	http_open_mime(&sys->req, KHTTP_200, KMIME_TEXT_HTML);
 
-	if (fd == -1) {
+	if ( ! rc) {
 		khttp_puts(&sys->req, "Error: ");
 		khttp_puts(&sys->req, buf);
-	} else {
-		khttp_template_fd(&sys->req, &t, fd, fn);
-		close(fd);
-	}
+	} else
+		tmpl_write(sys, &tp, &t);
 
+	tmpl_close(&tp);
 	free(buf);
 }
 
 /*
- * Sort the files first by type (directory first, then files), then by
- * name.
- * Used with qsort().
+ * Pack the listing order of an entry into an integer: the directory
+ * bit, then whether it's not "..", then the value sorted on, inverted
+ * if descending.
+ * For names, this is the first seven bytes, so only entries sharing
+ * those need be compared by name.
+ * Directories have no size to sort on, so go by name.
  */
-static int
-fref_cmp(const void *p1, const void *p2)
+static uint64_t
+listsel_key(const struct listsel *sel, int dir,
+	const char *name, const struct fattr *attr)
 {
-	const struct fref *f1 = p1, *f2 = p2;
+	uint64_t	 v = 0;
+	size_t		 i;
 
-	if (S_ISDIR(f1->st.st_mode) && !S_ISDIR(f2->st.st_mode))
-		return (-1);
-	if (S_ISDIR(f2->st.st_mode) && !S_ISDIR(f1->st.st_mode))
-		return 1;
+	if (name[0] == '.' && name[1] == '.' && name[2] == '\0')
+		return 0;
+
+	switch (sel->sort) {
+	case LISTSORT_SIZE:
+		if ( ! dir && attr->size > 0)
+			v = attr->size;
+		break;
+	case LISTSORT_MTIME:
+		if (attr->mtime > 0)
+			v = attr->mtime;
+		break;
+	default:
+		for (i = 0; i < 7 && name[i] != '\0'; i++)
+			v |= (uint64_t)(unsigned char)name[i] <<
+				(8 * (6 - i) + 6);
+		break;
+	}
 
-	return strcmp(f1->name, f2->name);
+	if (v > LISTKEY_VAL)
+		v = LISTKEY_VAL;
+	if (sel->desc)
+		v = ~v & LISTKEY_VAL;
+	return (dir ? 0 : UINT64_C(1) << 63) | UINT64_C(1) << 62 | v;
 }
 
 /*
- * See if the current user can access the "st" resource.
- * This checks all possible permissions EXCEPT for suid and friends.
- * It assumes that the user is not root.
- * (Otherwise the permission check is useless.)
+ * Order entries by sort key, then by name (reversed if that's what
+ * the key is of and it's descending).
  */
 static int
-check_canwrite(const struct stat *st)
+list_cmp(const struct listsel *sel, uint64_t key1, const char *name1,
+	uint64_t key2, const char *name2)
 {
-	int		 isw = 0, i, groupsz;
-	gid_t		 groups[NGROUPS_MAX];
+	int	 c;
 
-	if ((st->st_mode & S_IWOTH) ||
-	    (st->st_uid == getuid() && (st->st_mode & S_IWUSR)) ||
-	    (st->st_gid == getgid() && (st->st_mode & S_IWGRP))) {
-		isw = 1;
-	} else if (S_IWGRP & st->st_mode) {
-		groupsz = getgroups(sizeof(groups), groups);
-		if (groupsz == -1)
-			return (-1);
-		for (i = 0; i < groupsz; i++)
-			if (st->st_gid == groups[i])
-				break;
-		isw = i < groupsz;
-	}
-	return isw;
+	if (key1 != key2)
+		return key1 < key2 ? -1 : 1;
+	c = strcmp(name1, name2);
+	return sel->desc && sel->sort == LISTSORT_NAME ? -c : c;
 }
 
 /*
- * Fill in templates to the directory listing page.
+ * Order page slots of equal keys by name.
+ * Used with qsort().
  */
 static int
-get_dir_template(size_t index, void *arg)
+listkey_cmp(const void *p1, const void *p2)
 {
-	struct dirpage	*pg = arg;
-	struct khtmlreq	 req;
-	struct fref	*ff;
-	size_t		 i;
-	char		 classes[1024];
+	const struct listkey *k1 = p1, *k2 = p2;
 
-	classes[0] = '\0';
-	khtml_open(&req, &pg->sys->req, KHTML_PRETTY);
+	return strcmp(k1->name, k2->name);
+}
 
-	switch (index) {
-	case TEMPL_URL:
-		khtml_puts(&req, pg->sys->req.fullpath);
-		khtml_close(&req);
-		return 1;
-	case TEMPL_CLASSES:
-		strlcat(classes, pg->rdwr ?
-			" mutable" : " immutable", sizeof(classes));
-		strlcat(classes, pg->root ?
-			" root" : " nonroot", sizeof(classes));
-		strlcat(classes, pg->filesz > 0 ?
-			" nonempty" : " empty", sizeof(classes));
-		strlcat(classes, pg->rfilesz > 0 ?
-			" regnonempty" : " regempty", sizeof(classes));
-		strlcat(classes, pg->sys->loggedin ?
-			" loggedin" : "", sizeof(classes));
-		khtml_puts(&req, classes);
-		khtml_close(&req);
-		return 1;
-	case TEMPL_USER:
-		if (pg->sys->curuser != NULL)
-			khtml_puts(&req, pg->sys->curuser);
-		khtml_close(&req);
-		return 1;
-	case TEMPL_FILES:
-		break;
-	default:
-		khtml_close(&req);
-		return 0;
-	}
+/*
+ * Like listkey_cmp(), but descending.
+ */
+static int
+listkey_rcmp(const void *p1, const void *p2)
+{
 
-	if (pg->frefsz)
-		khtml_elem(&req, KELEM_UL);
+	return listkey_cmp(p2, p1);
+}
 
-	for (i = 0; i < pg->frefsz; i++) {
-		ff = &pg->frefs[i];
-		khtml_elem(&req, KELEM_LI);
-		khtml_attr(&req, KELEM_A,
-			KATTR_HREF, ff->fullname,
-			KATTR__MAX);
-		khtml_puts(&req, ff->name);
-		if (S_ISDIR(ff->st.st_mode))
-			khtml_puts(&req, "/");
-		khtml_closeelem(&req, 1);
+/*
+ * Compare entries "i" and "j" of the selection heap such that the root
+ * is the entry farthest from the cursor.
+ */
+static int
+listsel_cmp(const struct listsel *sel, size_t i, size_t j)
+{
+	const struct fref *f1 = &sel->frefs[sel->heap[i]],
+			  *f2 = &sel->frefs[sel->heap[j]];
+	int		   c;
 
-		khtml_elem(&req, KELEM_SPAN);
-		if (S_ISDIR(ff->st.st_mode)) {
-			khtml_puts(&req, "");
-		} else if (ff->st.st_size > 1024 * 1024 * 1024) {
-			khtml_int(&req,
-				ff->st.st_size / 1024/1024/1024);
-			khtml_puts(&req, " GB");
-		} else if (ff->st.st_size > 1024 * 1024) {
-			khtml_int(&req,
-				ff->st.st_size / 1024/1024);
-			khtml_puts(&req, " MB");
-		} else if (ff->st.st_size > 1024) {
-			khtml_int(&req, ff->st.st_size / 1024);
-			khtml_puts(&req, " KB");
-		} else {
-			khtml_int(&req, ff->st.st_size);
-			khtml_puts(&req, " B");
-		}
-		khtml_closeelem(&req, 1);
+	c = list_cmp(sel, f1->key, f1->name, f2->key, f2->name);
+	return sel->back ? -c : c;
+}
 
-		khtml_elem(&req, KELEM_SPAN);
-		khtml_puts(&req, ctime(&ff->st.st_ctim.tv_sec));
-		khtml_closeelem(&req, 1);
+static void
+listsel_swap(struct listsel *sel, size_t i, size_t j)
+{
+	size_t	 tmp;
 
-		if (pg->rdwr && !(S_ISDIR(ff->st.st_mode))) {
-			khtml_attr(&req, KELEM_FORM,
-				KATTR_METHOD, "post",
-				KATTR_ACTION, pg->fpath,
-				KATTR__MAX);
-			khtml_attr(&req, KELEM_INPUT,
-				KATTR_TYPE, "hidden",
-				KATTR_NAME, keys[KEY_OP].name,
-				KATTR_VALUE, "rmfile",
-				KATTR__MAX);
-			khtml_attr(&req, KELEM_INPUT,
-				KATTR_TYPE, "hidden",
-				KATTR_NAME, keys[KEY_FILENAME].name,
-				KATTR_VALUE, ff->name,
-				KATTR__MAX);
-			khtml_attr(&req, KELEM_DIV,
-				KATTR_CLASS, "field is-small",
-				KATTR__MAX);
+	tmp = sel->heap[i];
+	sel->heap[i] = sel->heap[j];
+	sel->heap[j] = tmp;
+}
+
+/*
+ * Restore the heap after replacing its root.
+ */
+static void
+listsel_down(struct listsel *sel)
+{
+	size_t	 i = 0, c;
+
+	while ((c = 2 * i + 1) < sel->heapsz) {
+		if (c + 1 < sel->heapsz &&
+		    listsel_cmp(sel, c + 1, c) > 0)
+			c++;
+		if (listsel_cmp(sel, c, i) <= 0)
+			break;
+		listsel_swap(sel, i, c);
+		i = c;
+	}
+}
+
+/*
+ * Offer the entry "name" with status "attr" to the selection "arg".
+ * This is a dircache_fn.
+ */
+static void
+listsel_add(const char *name, const struct fattr *attr, void *arg)
+{
+	struct listsel	*sel = arg;
+	struct fref	*ff;
+	size_t		 i;
+	uint64_t	 key;
+	int		 c;
+
+	if (strcmp(name, ".."))
+		sel->filesz++;
+	else if (sel->noparent)
+		return;
+	if (S_ISREG(attr->mode))
+		sel->rfilesz++;
+
+	key = listsel_key(sel, S_ISDIR(attr->mode), name, attr);
+
+	if (sel->cur != NULL) {
+		c = list_cmp(sel, key, name, sel->curkey, sel->cur);
+		if (sel->back ? c >= 0 : c <= 0) {
+			sel->outside++;
+			return;
+		}
+	}
+	sel->inside++;
+
+	/*
+	 * If the page is full, this replaces the root (the farthest
+	 * entry) if it's nearer.
+	 */
+
+	if (sel->heapsz == sel->max) {
+		ff = &sel->frefs[sel->heap[0]];
+		c = list_cmp(sel, key, name, ff->key, ff->name);
+		if (sel->back ? c <= 0 : c >= 0)
+			return;
+		ff->key = key;
+		ff->attr = *attr;
+		strlcpy(ff->name, name, sizeof(ff->name));
+		listsel_down(sel);
+		return;
+	}
+
+	i = sel->heapsz++;
+	sel->heap[i] = i;
+	ff = &sel->frefs[i];
+	ff->key = key;
+	ff->attr = *attr;
+	strlcpy(ff->name, name, sizeof(ff->name));
+	for ( ; i > 0 && listsel_cmp(sel, i, (i - 1) / 2) > 0;
+	     i = (i - 1) / 2)
+		listsel_swap(sel, i, (i - 1) / 2);
+}
+
+/*
+ * Empty the selection, keeping its parameters.
+ */
+static void
+listsel_reset(struct listsel *sel)
+{
+
+	sel->heapsz = sel->inside = sel->outside = 0;
+	sel->filesz = sel->rfilesz = 0;
+}
+
+/*
+ * Put the selected page in order at the start of "frefs".
+ * The slots are filled in order, so the first "heapsz" are in use.
+ * This is a radix sort of the keys, a byte at a time from the least
+ * significant and skipping bytes that all keys share, then a sort by
+ * name of any runs of equal keys.
+ * The slots are then moved into place along the cycles of the
+ * permutation.
+ */
+static void
+listsel_sort(struct listsel *sel)
+{
+	struct listkey	*a = sel->keys, *b = sel->keytmp, *t;
+	size_t		 count[256], i, j, k, n = sel->heapsz;
+	uint64_t	 all = ~UINT64_C(0), any = 0;
+	unsigned int	 shift;
+	struct fref	 tmp;
+
+	for (i = 0; i < n; i++) {
+		a[i].key = sel->frefs[i].key;
+		a[i].name = sel->frefs[i].name;
+		a[i].slot = i;
+		all &= a[i].key;
+		any |= a[i].key;
+	}
+
+	for (shift = 0; shift < 64; shift += 8) {
+		if ((((all ^ any) >> shift) & 0xff) == 0)
+			continue;
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(a[i].key >> shift) & 0xff]++;
+		for (j = 0, i = 0; i < 256; i++) {
+			k = count[i];
+			count[i] = j;
+			j += k;
+		}
+		for (i = 0; i < n; i++)
+			b[count[(a[i].key >> shift) & 0xff]++] = a[i];
+		t = a;
+		a = b;
+		b = t;
+	}
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && a[j].key == a[i].key; j++)
+			continue;
+		if (j - i > 1)
+			qsort(&a[i], j - i, sizeof(struct listkey),
+				sel->desc && sel->sort == LISTSORT_NAME ?
+				listkey_rcmp : listkey_cmp);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (a[i].slot == i)
+			continue;
+		tmp = sel->frefs[i];
+		for (j = i; a[j].slot != i; j = k) {
+			k = a[j].slot;
+			sel->frefs[j] = sel->frefs[k];
+			a[j].slot = j;
+		}
+		sel->frefs[j] = tmp;
+		a[j].slot = j;
+	}
+}
+
+/*
+ * Whether the (sorted) page has pages before and after it, and the
+ * position of its first entry, counting from one.
+ */
+static void
+listsel_nav(const struct listsel *sel, int *prev, int *next, size_t *first)
+{
+
+	if (sel->back) {
+		*prev = sel->inside > sel->heapsz;
+		*next = sel->outside > 0;
+		*first = sel->inside - sel->heapsz + 1;
+	} else {
+		*prev = sel->outside > 0;
+		*next = sel->inside > sel->heapsz;
+		*first = sel->outside + 1;
+	}
+}
+
+/*
+ * Write the cursor of entry "ff" into "buf".
+ * This is 'd' (directory) or 'f' (file) followed by the name, or if not
+ * ordered by name, by the value sorted on, a slash, and the name.
+ */
+static void
+listsel_cursor(const struct listsel *sel, const struct fref *ff,
+	char *buf, size_t sz)
+{
+	char	 type = S_ISDIR(ff->attr.mode) ? 'd' : 'f';
+
+	if (sel->sort == LISTSORT_SIZE)
+		snprintf(buf, sz, "%c%" PRId64 "/%s",
+			type, ff->attr.size, ff->name);
+	else if (sel->sort == LISTSORT_MTIME)
+		snprintf(buf, sz, "%c%" PRId64 "/%s",
+			type, ff->attr.mtime, ff->name);
+	else
+		snprintf(buf, sz, "%c%s", type, ff->name);
+}
+
+/*
+ * Parse the cursor "cp" (see listsel_cursor()) as the selection's.
+ * Returns zero if it's malformed.
+ */
+static int
+listsel_setcursor(struct listsel *sel, const char *cp)
+{
+	struct fattr	 attr;
+	char		*ep;
+	int		 dir;
+
+	if (cp[0] != 'd' && cp[0] != 'f')
+		return 0;
+	dir = cp[0] == 'd';
+	memset(&attr, 0, sizeof(struct fattr));
+
+	if (sel->sort != LISTSORT_NAME) {
+		errno = 0;
+		attr.size = attr.mtime = strtoll(cp + 1, &ep, 10);
+		if (errno != 0 || ep == cp + 1 || *ep != '/')
+			return 0;
+		cp = ep;
+	}
+	if (*++cp == '\0')
+		return 0;
+
+	sel->cur = cp;
+	sel->curkey = listsel_key(sel, dir, cp, &attr);
+	return 1;
+}
+
+/*
+ * Set up the selection from the request's "count" (unless "max" is
+ * non-zero), "sort" order, and either "after" or "before" cursor.
+ * The order is one of listsorts, prefixed with '-' if descending.
+ */
+static void
+listsel_init(const struct sys *sys, struct listsel *sel, size_t max)
+{
+	const struct kpair *kp;
+	const char	*cp;
+	size_t		 i;
+
+	memset(sel, 0, sizeof(struct listsel));
+
+	if ((kp = sys->req.fieldmap[KEY_SORT]) != NULL) {
+		cp = kp->parsed.s;
+		if ((sel->desc = *cp == '-'))
+			cp++;
+		for (i = 0; i < LISTSORT__MAX; i++)
+			if (strcmp(cp, listsorts[i]) == 0)
+				break;
+		if (i < LISTSORT__MAX)
+			sel->sort = i;
+		else
+			sel->desc = 0;
+	}
+
+	sel->max = LIST_PAGESZ;
+	if (max > 0)
+		sel->max = max;
+	else if ((kp = sys->req.fieldmap[KEY_COUNT]) != NULL &&
+	    kp->parsed.i > 0)
+		sel->max = kp->parsed.i > LIST_PAGEMAX ?
+			LIST_PAGEMAX : kp->parsed.i;
+	sel->frefs = kcalloc(sel->max, sizeof(struct fref));
+	sel->heap = kcalloc(sel->max, sizeof(size_t));
+	sel->keys = kcalloc(sel->max, sizeof(struct listkey));
+	sel->keytmp = kcalloc(sel->max, sizeof(struct listkey));
+
+	if ((kp = sys->req.fieldmap[KEY_BEFORE]) != NULL)
+		sel->back = 1;
+	else
+		kp = sys->req.fieldmap[KEY_AFTER];
+
+	if (kp == NULL || ! listsel_setcursor(sel, kp->parsed.s))
+		sel->back = 0;
+}
+
+/*
+ * See if the current user can write to a resource of the given mode and
+ * ownership.
+ * This checks all possible permissions EXCEPT for suid and friends.
+ * It assumes that the user is not root.
+ * (Otherwise the permission check is useless.)
+ */
+static int
+check_canwrite(mode_t mode, uid_t uid, gid_t gid)
+{
+	int		 isw = 0, i, groupsz;
+	gid_t		 groups[NGROUPS_MAX];
+
+	if ((mode & S_IWOTH) ||
+	    (uid == getuid() && (mode & S_IWUSR)) ||
+	    (gid == getgid() && (mode & S_IWGRP))) {
+		isw = 1;
+	} else if (S_IWGRP & mode) {
+		groupsz = getgroups(sizeof(groups), groups);
+		if (groupsz == -1)
+			return (-1);
+		for (i = 0; i < groupsz; i++)
+			if (gid == groups[i])
+				break;
+		isw = i < groupsz;
+	}
+	return isw;
+}
+
+/*
+ * Print a size in bytes in the largest unit it exceeds.
+ */
+static void
+get_dir_size(struct khtmlreq *req, int64_t size)
+{
+
+	if (size > 1024 * 1024 * 1024) {
+		khtml_int(req, size / 1024/1024/1024);
+		khtml_puts(req, " GB");
+	} else if (size > 1024 * 1024) {
+		khtml_int(req, size / 1024/1024);
+		khtml_puts(req, " MB");
+	} else if (size > 1024) {
+		khtml_int(req, size / 1024);
+		khtml_puts(req, " KB");
+	} else {
+		khtml_int(req, size);
+		khtml_puts(req, " B");
+	}
+}
+
+/*
+ * Get the totals of the subdirectory "ff" of the listing into "ds".
+ * Returns zero if there are none (or it's the parent).
+ */
+static int
+get_dir_sum(const struct sys *sys, const struct fref *ff,
+	struct dirsum *ds)
+{
+	char	 path[PATH_MAX];
+
+	if (strcmp(ff->name, "..") == 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s%s%s", sys->resource,
+		sys->resource[0] == '\0' ? "" : "/", ff->name);
+	return dirsum_get(sys, path, ds);
+}
+
+/*
+ * Link to the page of "pg" before (if "back") or after the entry "ff".
+ */
+static void
+get_dir_pagelink(const struct dirpage *pg, struct khtmlreq *req,
+	const struct fref *ff, int back)
+{
+	const struct listsel *sel = pg->sel;
+	char		 cur[NAME_MAX + 32];
+	char		*enc, *href;
+
+	listsel_cursor(sel, ff, cur, sizeof(cur));
+	enc = khttp_urlencode(cur);
+	kasprintf(&href, "%s?%s=%s&%s=%zu&%s=%s%s", pg->fpath,
+		keys[back ? KEY_BEFORE : KEY_AFTER].name, enc,
+		keys[KEY_COUNT].name, sel->max, keys[KEY_SORT].name,
+		sel->desc ? "-" : "", listsorts[sel->sort]);
+	khtml_attr(req, KELEM_A,
+		KATTR_CLASS, back ?
+			"pagination-previous" : "pagination-next",
+		KATTR_HREF, href,
+		KATTR__MAX);
+	khtml_puts(req, back ? "Previous" : "Next");
+	khtml_closeelem(req, 1);
+	free(href);
+	free(enc);
+}
+
+/*
+ * Links to the listing in each order.
+ * Name sorts ascending first, the others (largest, newest) descending;
+ * following the link of the current order reverses it.
+ */
+static void
+get_dir_sorts(const struct dirpage *pg, struct khtmlreq *req)
+{
+	static const char *const labels[LISTSORT__MAX] = {
+		"Name", /* LISTSORT_NAME */
+		"Size", /* LISTSORT_SIZE */
+		"Modified", /* LISTSORT_MTIME */
+	};
+	const struct listsel *sel = pg->sel;
+	size_t		 i;
+	int		 desc;
+	char		*href;
+
+	khtml_attr(req, KELEM_DIV,
+		KATTR_CLASS, "tabs is-small",
+		KATTR__MAX);
+	khtml_elem(req, KELEM_UL);
+	for (i = 0; i < LISTSORT__MAX; i++) {
+		desc = i != LISTSORT_NAME;
+		if (i == sel->sort)
+			desc = ! sel->desc;
+		kasprintf(&href, "%s?%s=%s%s%s%s", pg->fpath,
+			keys[KEY_SORT].name, desc ? "-" : "",
+			listsorts[i], pg->chunked ? "&" : "",
+			pg->chunked ? "order=chunk" : "");
+		khtml_attr(req, KELEM_LI,
+			KATTR_CLASS, i == sel->sort ? "is-active" : "",
+			KATTR__MAX);
+		khtml_attr(req, KELEM_A,
+			KATTR_HREF, href,
+			KATTR__MAX);
+		khtml_puts(req, labels[i]);
+		if (i == sel->sort)
+			khtml_puts(req, sel->desc ? " \xe2\x86\x93" :
+				" \xe2\x86\x91");
+		khtml_closeelem(req, 2);
+		free(href);
+	}
+	khtml_closeelem(req, 2);
+}
+
+/*
+ * Navigation between pages of a directory listing, if it has more than
+ * one.
+ */
+static void
+get_dir_pager(const struct dirpage *pg, struct khtmlreq *req)
+{
+	const struct listsel *sel = pg->sel;
+	size_t		 first, total = sel->inside + sel->outside;
+	int		 prev, next;
+
+	listsel_nav(sel, &prev, &next, &first);
+
+	if ((!prev && !next) || sel->heapsz == 0)
+		return;
+
+	khtml_attr(req, KELEM_NAV,
+		KATTR_CLASS, "pagination",
+		KATTR__MAX);
+	if (prev)
+		get_dir_pagelink(pg, req, &sel->frefs[0], 1);
+	if (next)
+		get_dir_pagelink(pg, req,
+			&sel->frefs[sel->heapsz - 1], 0);
+	khtml_elem(req, KELEM_P);
+	khtml_puts(req, "Showing ");
+	khtml_int(req, first);
+	khtml_puts(req, "-");
+	khtml_int(req, first + sel->heapsz - 1);
+	khtml_puts(req, " of ");
+	khtml_int(req, total);
+	khtml_closeelem(req, 2);
+}
+
+/*
+ * Send one row of a directory listing, opening the list if this is the
+ * first.
+ */
+static void
+get_dir_row(struct dirpage *pg, const struct fref *ff)
+{
+	struct khtmlreq	*req = pg->req;
+	time_t		 ctim;
+	struct dirsum	 ds;
+	char		 href[PATH_MAX * 2];
+
+	if (pg->rows++ == 0)
+		khtml_elem(req, KELEM_UL);
+
+	snprintf(href, sizeof(href), "%s%s", pg->fpath, ff->name);
+	khtml_elem(req, KELEM_LI);
+	khtml_attr(req, KELEM_A,
+		KATTR_HREF, href,
+		KATTR__MAX);
+	khtml_puts(req, ff->name);
+	if (S_ISDIR(ff->attr.mode))
+		khtml_puts(req, "/");
+	khtml_closeelem(req, 1);
+
+	/* Directories show their totals, if we have them. */
+
+	khtml_elem(req, KELEM_SPAN);
+	if ( ! S_ISDIR(ff->attr.mode))
+		get_dir_size(req, ff->attr.size);
+	else if (get_dir_sum(pg->sys, ff, &ds)) {
+		khtml_int(req, ds.files);
+		khtml_puts(req, ds.files == 1 ? " file, " : " files, ");
+		get_dir_size(req, ds.bytes);
+	}
+	khtml_closeelem(req, 1);
+
+	khtml_elem(req, KELEM_SPAN);
+	ctim = ff->attr.ctime;
+	khtml_puts(req, ctime(&ctim));
+	khtml_closeelem(req, 1);
+
+	if (pg->rdwr && !(S_ISDIR(ff->attr.mode))) {
+		khtml_attr(req, KELEM_FORM,
+			KATTR_METHOD, "post",
+			KATTR_ACTION, pg->fpath,
+			KATTR__MAX);
+		khtml_attr(req, KELEM_INPUT,
+			KATTR_TYPE, "hidden",
+			KATTR_NAME, keys[KEY_OP].name,
+			KATTR_VALUE, "rmfile",
+			KATTR__MAX);
+		khtml_attr(req, KELEM_INPUT,
+			KATTR_TYPE, "hidden",
+			KATTR_NAME, keys[KEY_FILENAME].name,
+			KATTR_VALUE, ff->name,
+			KATTR__MAX);
+		khtml_attr(req, KELEM_DIV,
+			KATTR_CLASS, "field is-small",
+			KATTR__MAX);
+
+		/*
+		 * Disallow deletion if we don't have access
+		 * rights to the file.
+		 */
 
-			/*
-			 * Disallow deletion if we don't have access
-			 * rights to the file.
-			 */
-
-			if (check_canwrite(&ff->st) > 0)
-				khtml_attr(&req, KELEM_BUTTON,
-					KATTR_CLASS, "button "
-						"is-danger is-small",
-					KATTR_TITLE, "Delete",
-					KATTR_TYPE, "submit",
-					KATTR__MAX);
-			else
-				khtml_attr(&req, KELEM_BUTTON,
-					KATTR_CLASS, "button "
-						"is-danger is-small",
-					KATTR_TITLE, "Delete",
-					KATTR_DISABLED, "disabled",
-					KATTR_TYPE, "submit",
-					KATTR__MAX);
-			khtml_attr(&req, KELEM_SPAN,
-				KATTR_CLASS, "icon is-small",
+		if (check_canwrite(ff->attr.mode,
+		    ff->attr.uid, ff->attr.gid) > 0)
+			khtml_attr(req, KELEM_BUTTON,
+				KATTR_CLASS, "button "
+					"is-danger is-small",
+				KATTR_TITLE, "Delete",
+				KATTR_TYPE, "submit",
 				KATTR__MAX);
-			khtml_attr(&req, KELEM_I,
-				KATTR_CLASS, "fa fa-times",
+		else
+			khtml_attr(req, KELEM_BUTTON,
+				KATTR_CLASS, "button "
+					"is-danger is-small",
+				KATTR_TITLE, "Delete",
+				KATTR_DISABLED, "disabled",
+				KATTR_TYPE, "submit",
 				KATTR__MAX);
-			khtml_closeelem(&req, 5);
-		}
+		khtml_attr(req, KELEM_SPAN,
+			KATTR_CLASS, "icon is-small",
+			KATTR__MAX);
+		khtml_attr(req, KELEM_I,
+			KATTR_CLASS, "fa fa-times",
+			KATTR__MAX);
+		khtml_closeelem(req, 5);
+	}
 
-		khtml_closeelem(&req, 1);
+	khtml_closeelem(req, 1);
+}
+
+/*
+ * Whether a directory entry is listed: directories (but not the current
+ * one, or the parent when in the root) and regular files that aren't
+ * dot-files.
+ */
+static int
+get_dir_want(const struct dirent *dp, int root)
+{
+
+	if (dp->d_type != DT_DIR && dp->d_type != DT_REG)
+		return 0;
+	if (dp->d_type == DT_DIR && strcmp(dp->d_name, ".") == 0)
+		return 0;
+	if (dp->d_type == DT_REG && dp->d_name[0] == '.')
+		return 0;
+	if (root && strcmp(dp->d_name, "..") == 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * Count the entries of "pg->dir" for the page's classes, then rewind.
+ * This needs no fstatat(2), so it's cheap next to the scan itself.
+ */
+static void
+get_dir_count(struct dirpage *pg)
+{
+	struct dirent	*dp;
+
+	while ((dp = readdir(pg->dir)) != NULL) {
+		if ( ! get_dir_want(dp, pg->root))
+			continue;
+		if (strcmp(dp->d_name, ".."))
+			pg->filesz++;
+		if (dp->d_type == DT_REG)
+			pg->rfilesz++;
+	}
+	rewinddir(pg->dir);
+}
+
+/*
+ * Read "pg->dir", passing each entry to "fn" with "arg" and to the
+ * listing cache, then close it.
+ */
+static void
+get_dir_scan(struct dirpage *pg, dircache_fn fn, void *arg)
+{
+	struct dirent	*dp;
+	struct stat	 st;
+	struct fattr	 attr;
+	int		 nfd = dirfd(pg->dir);
+
+	while ((dp = readdir(pg->dir)) != NULL) {
+		if ( ! get_dir_want(dp, pg->root))
+			continue;
+		if (fstatat(nfd, dp->d_name, &st, 0) == -1)
+			continue;
+		fattr_stat(&attr, &st);
+		dircache_add(pg->dc, dp->d_name, &attr);
+		(*fn)(dp->d_name, &attr, arg);
+	}
+
+	closedir(pg->dir);
+	pg->dir = NULL;
+	dircache_finish(pg->dc);
+	pg->dc = NULL;
+}
+
+/*
+ * Take an entry into the current chunk, sending the chunk (sorted) when
+ * it's full.
+ * This is a dircache_fn.
+ */
+static void
+get_dir_chunk(const char *name, const struct fattr *attr, void *arg)
+{
+	struct dirpage	*pg = arg;
+	struct listsel	*sel = pg->sel;
+	size_t		 i;
+
+	if (name != NULL) {
+		sel->frefs[sel->heapsz].key = listsel_key(sel,
+			S_ISDIR(attr->mode), name, attr);
+		sel->frefs[sel->heapsz].attr = *attr;
+		strlcpy(sel->frefs[sel->heapsz].name, name,
+			sizeof(sel->frefs[0].name));
+		if (++sel->heapsz < sel->max)
+			return;
 	}
 
+	listsel_sort(sel);
+	for (i = 0; i < sel->heapsz; i++)
+		get_dir_row(pg, &sel->frefs[i]);
+	sel->heapsz = 0;
+	khttp_flush(&pg->sys->req);
+}
+
+/*
+ * Send the rows of the listing.
+ * Everything up to here has been sent already, so if the directory
+ * hasn't been scanned yet, the client has the page head while we do.
+ * If chunked, rows go out as they're scanned, sorted only within each
+ * chunk; otherwise, the page is selected from all entries, then sent.
+ */
+static void
+get_dir_files(struct dirpage *pg, struct khtmlreq *req)
+{
+	size_t	 i;
+
+	pg->req = req;
+	khttp_flush(&pg->sys->req);
+
+	if (pg->chunked) {
+		get_dir_scan(pg, get_dir_chunk, pg);
+		get_dir_chunk(NULL, NULL, pg);
+	} else if (pg->dir != NULL)
+		get_dir_scan(pg, listsel_add, pg->sel);
+
+	if ( ! pg->chunked) {
+		listsel_sort(pg->sel);
+		for (i = 0; i < pg->sel->heapsz; i++)
+			get_dir_row(pg, &pg->sel->frefs[i]);
+	}
+	pg->req = NULL;
+
+	/* Rows read directory totals, so sandbox only now. */
+
+	if (pledge("stdio", NULL) == -1)
+		kutil_err(&pg->sys->req, pg->sys->curuser, "pledge");
+}
+
+/*
+ * Fill in templates to the directory listing page.
+ */
+static int
+get_dir_template(size_t index, void *arg)
+{
+	struct dirpage	*pg = arg;
+	struct khtmlreq	 req;
+	char		 classes[1024];
+
+	classes[0] = '\0';
+	khtml_open(&req, &pg->sys->req, KHTML_PRETTY);
+
+	switch (index) {
+	case TEMPL_URL:
+		khtml_puts(&req, pg->sys->req.fullpath);
+		khtml_close(&req);
+		return 1;
+	case TEMPL_CLASSES:
+		strlcat(classes, pg->rdwr ?
+			" mutable" : " immutable", sizeof(classes));
+		strlcat(classes, pg->root ?
+			" root" : " nonroot", sizeof(classes));
+		strlcat(classes, pg->filesz > 0 ?
+			" nonempty" : " empty", sizeof(classes));
+		strlcat(classes, pg->rfilesz > 0 ?
+			" regnonempty" : " regempty", sizeof(classes));
+		strlcat(classes, pg->sys->loggedin ?
+			" loggedin" : "", sizeof(classes));
+		khtml_puts(&req, classes);
+		khtml_close(&req);
+		return 1;
+	case TEMPL_USER:
+		if (pg->sys->curuser != NULL)
+			khtml_puts(&req, pg->sys->curuser);
+		khtml_close(&req);
+		return 1;
+	case TEMPL_FILES:
+		break;
+	case TEMPL_PAGER:
+		get_dir_sorts(pg, &req);
+		if ( ! pg->chunked)
+			get_dir_pager(pg, &req);
+		khtml_close(&req);
+		return 1;
+	default:
+		khtml_close(&req);
+		return 0;
+	}
+
+	get_dir_files(pg, &req);
+
 	/* XXX: use CSS ids/subclassing and keep in XML. */
 
-	if (pg->frefsz == 0) {
+	if (pg->rows == 0) {
 		khtml_elem(&req, KELEM_P);
 		khtml_puts(&req,
 			"No files or directories to list. "
@@ -663,25 +1612,170 @@ get_dir_template(size_t index, void *arg)
 	return 1;
 }
 
+/*
+ * Whether to list a directory as JSON: if asked by "format=json", or by
+ * an Accept header naming JSON but not HTML (as browsers do).
+ */
+static int
+get_dir_isjson(const struct sys *sys)
+{
+	const struct kpair *kp;
+	const struct khead *h;
+
+	if ((kp = sys->req.fieldmap[KEY_FORMAT]) != NULL)
+		return strcmp(kp->parsed.s, "json") == 0;
+	if ((h = sys->req.reqmap[KREQU_ACCEPT]) == NULL)
+		return 0;
+	return strcasestr(h->val, "application/json") != NULL &&
+		strcasestr(h->val, "text/html") == NULL;
+}
+
+/*
+ * Emit the cursor value of "ff", or null if "ff" is NULL.
+ */
+static void
+get_dir_json_cursor(struct kjsonreq *req, const struct listsel *sel,
+	const char *key, const struct fref *ff)
+{
+	char	 cur[NAME_MAX + 32];
+
+	if (ff == NULL) {
+		kjson_putnullp(req, key);
+		return;
+	}
+	listsel_cursor(sel, ff, cur, sizeof(cur));
+	kjson_putstringp(req, key, cur);
+}
+
+/*
+ * Emit the selected page of a directory listing as JSON.
+ * The parent isn't an entry (see get_dir()): it's implied by "path".
+ * Sizes and times are numbers: bytes and seconds since the epoch.
+ * Subdirectories have their recursive totals, if we have them.
+ * The "prev" and "next" cursors are the values of the "before" and
+ * "after" parameters for the neighbouring pages, if any.
+ */
+static void
+get_dir_json(struct sys *sys, const struct listsel *sel, int rdwr)
+{
+	struct kjsonreq	 req;
+	const struct fref *ff;
+	struct dirsum	 ds;
+	size_t		 i, first;
+	int		 prev, next;
+
+	listsel_nav(sel, &prev, &next, &first);
+
+	kjson_open(&req, &sys->req);
+	kjson_obj_open(&req);
+	kjson_putstringp(&req, "path", sys->resource);
+	kjson_putboolp(&req, "writable", rdwr);
+	kjson_putintp(&req, "total", sel->inside + sel->outside);
+	kjson_putintp(&req, "first", sel->heapsz ? first : 0);
+	kjson_putstringp(&req, "sort", listsorts[sel->sort]);
+	kjson_putboolp(&req, "descending", sel->desc);
+	get_dir_json_cursor(&req, sel, "prev",
+		prev && sel->heapsz ? &sel->frefs[0] : NULL);
+	get_dir_json_cursor(&req, sel, "next",
+		next && sel->heapsz ?
+		&sel->frefs[sel->heapsz - 1] : NULL);
+	kjson_arrayp_open(&req, "entries");
+	for (i = 0; i < sel->heapsz; i++) {
+		ff = &sel->frefs[i];
+		kjson_obj_open(&req);
+		kjson_putstringp(&req, "name", ff->name);
+		kjson_putstringp(&req, "type",
+			S_ISDIR(ff->attr.mode) ? "dir" : "file");
+		kjson_putintp(&req, "size", ff->attr.size);
+		kjson_putintp(&req, "mtime", ff->attr.mtime);
+		kjson_putintp(&req, "ctime", ff->attr.ctime);
+		if (S_ISDIR(ff->attr.mode) &&
+		    get_dir_sum(sys, ff, &ds)) {
+			kjson_objp_open(&req, "totals");
+			kjson_putintp(&req, "bytes", ds.bytes);
+			kjson_putintp(&req, "files", ds.files);
+			kjson_putintp(&req, "dirs", ds.dirs);
+			kjson_obj_close(&req);
+		}
+		kjson_obj_close(&req);
+	}
+	kjson_array_close(&req);
+	kjson_obj_close(&req);
+	kjson_close(&req);
+}
+
 /*
  * Print a directory listing.
  * This is preceded by the form for directory creation and file upload.
- * FIXME: use directory mtime and cache control.
+ * The listing is validated by the directory's mtime, which our own
+ * mutation paths always bump, so check for a conditional hit before
+ * reading anything.
  */
 static void
-get_dir(struct sys *sys, int rdwr)
+get_dir(struct sys *sys, const struct stat *dst, int rdwr)
 {
-	int		 nfd, nnfd, fd;
-	struct stat	 st;
-	char		*fpath;
-	DIR		*dir;
-	struct dirent	*dp;
+	int		 nfd, rc;
+	char		*fpath = NULL;
 	int		 fl = O_RDONLY | O_DIRECTORY;
-	size_t		 filesz = 0, rfilesz = 0, rffilesz = 0, i;
 	struct ktemplate t;
-	struct fref	*files = NULL;
+	struct tmpl	 tp;
+	struct listsel	 sel;
 	struct dirpage	 dirpage;
-	const char	*fn = DATADIR "/page.xml";
+	const struct kpair *kp;
+	char		 etag[64];
+	int		 json = get_dir_isjson(sys);
+	struct dirsum	 ds;
+
+	/*
+	 * If our totals are missing or old, have them rebuilt while we
+	 * carry on: subdirectories show theirs once it's done.
+	 */
+
+	rc = dirsum_get(sys, sys->resource, &ds);
+	if (dirsum_stale(&ds, rc))
+		dirsum_rebuild(sys, sys->resource);
+
+	khttp_head(&sys->req, kresps[KRESP_VARY], "Accept");
+	etag_dir(sys, dst, &ds, rdwr, json, etag, sizeof(etag));
+	if (http_not_modified(&sys->req, etag, dst->st_mtim.tv_sec))
+		return;
+
+	/* HEAD: the validators are all we have to give. */
+
+	if (sys->req.method == KMETHOD_HEAD) {
+		http_head_cache(&sys->req, etag, dst->st_mtim.tv_sec);
+		http_open_mime(&sys->req, KHTTP_200,
+			json ? KMIME_APP_JSON : KMIME_TEXT_HTML);
+		return;
+	}
+
+	memset(&dirpage, 0, sizeof(struct dirpage));
+	dirpage.rdwr = rdwr;
+	dirpage.root = '\0' == sys->resource[0];
+	dirpage.sel = &sel;
+	dirpage.sys = sys;
+	dirpage.chunked = ! json &&
+		(kp = sys->req.fieldmap[KEY_ORDER]) != NULL &&
+		strcmp(kp->parsed.s, "chunk") == 0;
+
+	/*
+	 * Use the cached listing if it's as new as the directory.
+	 * Otherwise, we'll read the directory and cache what we find.
+	 * Either way, only keep the page we're going to show.
+	 * A chunked listing is always read afresh, as it's sent.
+	 */
+
+	listsel_init(sys, &sel, dirpage.chunked ? LIST_CHUNK : 0);
+	sel.noparent = json;
+	if (! dirpage.chunked &&
+	    (rc = dircache_load(sys, dst, listsel_add, &sel)) != 0) {
+		if (rc > 0) {
+			dirpage.filesz = sel.filesz;
+			dirpage.rfilesz = sel.rfilesz;
+			goto have;
+		}
+		listsel_reset(&sel);
+	}
 
 	if ('\0' != sys->resource[0]) {
 		nfd = openat(sys->filefd, sys->resource, fl, 0);
@@ -694,85 +1788,56 @@ get_dir(struct sys *sys, int rdwr)
 
 	if (-1 == nfd) {
 		errorpage(sys, "Cannot open \"%s\".", sys->resource);
-		return;
+		goto out;
 	}
 
-	/*
-	 * Get the DIR pointer from the directory request.
-	 * We clone nfd because fdopendir() will take ownership.
-	 * Then read all acceptable entries into our "files" array.
-	 */
+	/* The DIR pointer takes ownership of nfd. */
 
-	if (-1 == (nnfd = dup(nfd))) {
-		kutil_warn(&sys->req, sys->curuser, "dup");
-		errorpage(sys, "System error.");
-		return;
-	} else if (NULL == (dir = fdopendir(nnfd))) {
+	if (NULL == (dirpage.dir = fdopendir(nfd))) {
 		kutil_warn(&sys->req, sys->curuser,
 			"%s: fdopendir", sys->resource);
 		errorpage(sys, "System error.");
-		close(nnfd);
-		return;
+		close(nfd);
+		goto out;
 	}
 
-	while (NULL != (dp = readdir(dir))) {
-		/*
-		 * Disallow non-regular or directory, the current
-		 * directory, any dot-files, and previous when in the
-		 * root.
-		 */
-
-		if ((DT_DIR != dp->d_type &&
-		     DT_REG != dp->d_type) ||
-		    (DT_DIR == dp->d_type &&
-		     0 == strcmp(dp->d_name, ".")) ||
-		    (DT_REG == dp->d_type &&
-		     '.' == dp->d_name[0]) ||
-		    (0 == strcmp(dp->d_name, "..") &&
-		    '\0' == sys->resource[0]))
-			continue;
+	dirpage.dc = dircache_create(sys, dst);
 
-		if (-1 == fstatat(nfd, dp->d_name, &st, 0))
-			continue;
+	/*
+	 * JSON is sent all at once, so scan now.
+	 * For the page, only count now: the scan is deferred until the
+	 * page head has been sent.
+	 */
 
-		kasprintf(&fpath, "%s/%s%s%s", sys->req.pname,
-			sys->resource,
-			'\0' != sys->resource[0] ? "/" : "",
-			dp->d_name);
-		files = kreallocarray(files,
-			filesz + 1, sizeof(struct fref));
-		files[filesz].st = st;
-		files[filesz].name = kstrdup(dp->d_name);
-		files[filesz].fullname = fpath;
-		filesz++;
-		if (strcmp(dp->d_name, ".."))
-			rfilesz++;
-		if (DT_REG == dp->d_type)
-			rffilesz++;
+	if (json) {
+		get_dir_scan(&dirpage, listsel_add, &sel);
+		dirpage.filesz = sel.filesz;
+		dirpage.rfilesz = sel.rfilesz;
+	} else
+		get_dir_count(&dirpage);
+have:
+	/* JSON needs neither the template nor anything else. */
+
+	if (json) {
+		if (-1 == pledge("flock rpath stdio", NULL))
+			kutil_err(&sys->req, sys->curuser, "pledge");
+		listsel_sort(&sel);
+		http_head_cache(&sys->req, etag, dst->st_mtim.tv_sec);
+		http_open_mime(&sys->req, KHTTP_200, KMIME_APP_JSON);
+		get_dir_json(sys, &sel, rdwr);
+		goto out;
 	}
 
-	closedir(dir);
-
-	/* Open our template page and sandbox ourselves. */
-
-	if (-1 == (fd = open(fn, O_RDONLY, 0)))
-		kutil_warn(&sys->req, sys->curuser, "%s", fn);
-	if (-1 == pledge("stdio", NULL))
-		kutil_err(&sys->req, sys->curuser, "pledge");
+	/*
+	 * Get our template page, opening it if not compiled in.
+	 * We're sandboxed in get_dir_files() once the scan is done.
+	 */
 
-	qsort(files, filesz, sizeof(struct fref), fref_cmp);
+	tmpl_open(sys, "page.xml", &tp);
 
 	kasprintf(&fpath, "%s/%s%s", sys->req.pname,
 		sys->resource, '\0' != sys->resource[0] ? "/" : "");
-
-	dirpage.frefs = files;
-	dirpage.frefsz = filesz;
-	dirpage.filesz = rfilesz;
-	dirpage.rfilesz = rffilesz;
-	dirpage.rdwr = rdwr;
 	dirpage.fpath = fpath;
-	dirpage.root = '\0' == sys->resource[0];
-	dirpage.sys = sys;
 
 	/*
 	 * No more errors reported.
@@ -786,54 +1851,605 @@ get_dir(struct sys *sys, int rdwr)
 	t.arg = &dirpage;
 	t.cb = get_dir_template;
 
+	http_head_cache(&sys->req, etag, dst->st_mtim.tv_sec);
 	http_open(&sys->req, KHTTP_200);
 
-	if (-1 != fd) {
-		khttp_template_fd(&sys->req, &t, fd, fn);
-		close(fd);
+	tmpl_write(sys, &tp, &t);
+	tmpl_close(&tp);
+out:
+	/* If we never got to scanning, there's nothing to cache. */
+
+	if (dirpage.dir != NULL)
+		closedir(dirpage.dir);
+	dircache_discard(dirpage.dc);
+	free(fpath);
+	free(sel.frefs);
+	free(sel.heap);
+	free(sel.keys);
+	free(sel.keytmp);
+}
+
+/*
+ * Parse a non-negative decimal offset at "*cp", advancing "*cp" past
+ * it.
+ * Returns zero if there are no digits or the value overflows.
+ */
+static int
+range_offset(const char **cp, off_t *v)
+{
+	const char	*p = *cp;
+
+	for (*v = 0; isdigit((unsigned char)*p); p++) {
+		if (*v > (INT64_MAX - (*p - '0')) / 10)
+			return 0;
+		*v = *v * 10 + (*p - '0');
+	}
+	if (p == *cp)
+		return 0;
+	*cp = p;
+	return 1;
+}
+
+/*
+ * Parse an RFC 7233 "Range" header value "hdr" against a file of size
+ * "size" into "rs", which holds at most RANGE_MAX entries.
+ * Unsatisfiable ranges are dropped.
+ * Returns -1 if the header is malformed or has too many ranges (the
+ * header is to be ignored), otherwise the number of satisfiable
+ * ranges, which if zero means we should respond with a 416.
+ */
+static ssize_t
+range_parse(const char *hdr, off_t size, struct range *rs)
+{
+	const char	*cp = hdr;
+	size_t		 rsz = 0, specs = 0;
+	off_t		 start, end;
+
+	while (isspace((unsigned char)*cp))
+		cp++;
+	if (strncasecmp(cp, "bytes=", 6))
+		return -1;
+	cp += 6;
+
+	for (;;) {
+		while (isspace((unsigned char)*cp))
+			cp++;
+		if (++specs > RANGE_MAX)
+			return -1;
+
+		if ('-' == *cp) {
+			/* Suffix range: the last "end" bytes. */
+			cp++;
+			if ( ! range_offset(&cp, &end))
+				return -1;
+			if (end > 0 && size > 0) {
+				rs[rsz].start = end > size ? 0 : size - end;
+				rs[rsz].end = size - 1;
+				rsz++;
+			}
+		} else {
+			if ( ! range_offset(&cp, &start) || '-' != *cp++)
+				return -1;
+			if (isdigit((unsigned char)*cp)) {
+				if ( ! range_offset(&cp, &end))
+					return -1;
+				if (end < start)
+					return -1;
+			} else
+				end = size - 1;
+			if (start < size) {
+				rs[rsz].start = start;
+				rs[rsz].end = end >= size ? size - 1 : end;
+				rsz++;
+			}
+		}
+
+		while (isspace((unsigned char)*cp))
+			cp++;
+		if ('\0' == *cp)
+			break;
+		if (',' != *cp++)
+			return -1;
+	}
+
+	return rsz;
+}
+
+/*
+ * Write the inclusive range "start" through "end" of the open file
+ * "fd" to the output.
+ * Reads are large and page-aligned, and go directly from the file into
+ * the output with no intermediary scanning.
+ * Returns zero if reading or writing fails, non-zero on success.
+ */
+static int
+send_range(struct sys *sys, int fd, off_t start, off_t end)
+{
+	static char	 buf[STREAM_BUFSZ]
+			  __attribute__((aligned(4096)));
+	ssize_t		 ssz;
+	size_t		 sz;
+
+	while (start <= end) {
+		sz = (uintmax_t)(end - start + 1) > sizeof(buf) ?
+			sizeof(buf) : (size_t)(end - start + 1);
+		if ((ssz = pread(fd, buf, sz, start)) == -1) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: pread", sys->resource);
+			return 0;
+		} else if (ssz == 0) {
+			kutil_warnx(&sys->req, sys->curuser,
+				"%s: short read", sys->resource);
+			return 0;
+		}
+		if (khttp_write(&sys->req, buf, ssz) != KCGI_OK)
+			return 0;
+		start += ssz;
+	}
+
+	return 1;
+}
+
+/*
+ * Respond to a "Range" request with 206 (partial content) or 416
+ * (unsatisfiable).
+ * A single range is sent as-is; multiple ranges are wrapped in a
+ * multipart/byteranges document.
+ * Returns zero if the range header was ignored and the full file should
+ * be sent instead, non-zero if the request was handled.
+ */
+static int
+get_file_range(struct sys *sys, int fd,
+	const struct stat *st, const char *etag)
+{
+	struct range	 rs[RANGE_MAX];
+	ssize_t		 rsz;
+	size_t		 i;
+	const char	*mime;
+	char		 bound[32], type[64];
+	const struct khead *h;
+	time_t		 t;
+
+	/*
+	 * If-Range: only honour the range if the client's copy is the
+	 * current one, identified either by strong tag or exact date.
+	 */
+
+	if ((h = sys->req.reqmap[KREQU_IF_RANGE]) != NULL) {
+		if (h->val[0] == '"' || strncmp(h->val, "W/", 2) == 0) {
+			if ( ! etag_match(h->val, etag, 1))
+				return 0;
+		} else if ( ! http_date2epoch(h->val, &t) ||
+		    t != st->st_mtim.tv_sec)
+			return 0;
+	}
+
+	rsz = range_parse(sys->req.reqmap[KREQU_RANGE]->val,
+		st->st_size, rs);
+
+	if (rsz < 0)
+		return 0;
+
+	mime = http_mime(&sys->req);
+
+	if (rsz == 0) {
+		khttp_head(&sys->req, kresps[KRESP_CONTENT_RANGE],
+			"bytes */%" PRId64, (int64_t)st->st_size);
+		http_open_mime(&sys->req, KHTTP_416, KMIME_TEXT_PLAIN);
+		return 1;
+	}
+
+	khttp_head(&sys->req, kresps[KRESP_ACCEPT_RANGES], "bytes");
+	http_head_cache(&sys->req, etag, st->st_mtim.tv_sec);
+
+	/*
+	 * Content-Length is exact, so disable the (optional)
+	 * compression of the body by kcgi.
+	 */
+
+	if (rsz == 1) {
+		http_head_type(&sys->req, KHTTP_206, mime);
+		khttp_head(&sys->req, kresps[KRESP_CONTENT_RANGE],
+			"bytes %" PRId64 "-%" PRId64 "/%" PRId64,
+			(int64_t)rs[0].start, (int64_t)rs[0].end,
+			(int64_t)st->st_size);
+		khttp_head(&sys->req, kresps[KRESP_CONTENT_LENGTH],
+			"%" PRId64, (int64_t)(rs[0].end - rs[0].start + 1));
+		khttp_body_compress(&sys->req, 0);
+		send_range(sys, fd, rs[0].start, rs[0].end);
+		return 1;
+	}
+
+	snprintf(bound, sizeof(bound), "%08" PRIx32 "%08" PRIx32,
+		arc4random(), arc4random());
+	snprintf(type, sizeof(type),
+		"multipart/byteranges; boundary=%s", bound);
+	http_head_type(&sys->req, KHTTP_206, type);
+	khttp_body_compress(&sys->req, 0);
+
+	for (i = 0; i < (size_t)rsz; i++) {
+		khttp_printf(&sys->req, "\r\n--%s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Range: bytes %" PRId64 "-%" PRId64
+			"/%" PRId64 "\r\n\r\n", bound, mime,
+			(int64_t)rs[i].start, (int64_t)rs[i].end,
+			(int64_t)st->st_size);
+		if ( ! send_range(sys, fd, rs[i].start, rs[i].end))
+			return 1;
+	}
+	khttp_printf(&sys->req, "\r\n--%s--\r\n", bound);
+	return 1;
+}
+
+/*
+ * Write all of "buf" to the file "fd".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+write_all(int fd, const char *buf, size_t sz)
+{
+	ssize_t	 ssz;
+
+	while (sz > 0) {
+		if ((ssz = write(fd, buf, sz)) == -1)
+			return 0;
+		buf += ssz;
+		sz -= ssz;
+	}
+	return 1;
+}
+
+/*
+ * Compress the open file "fd" with gzip, writing the output both to
+ * the client and, if "tfd" is not -1, to the sidecar "tfd".
+ * If the client goes away, keep going so that the sidecar is complete.
+ * Returns zero if the sidecar could not be completed, non-zero on
+ * success.
+ */
+static int
+gzip_stream(struct sys *sys, int fd, int tfd)
+{
+	static char	 in[STREAM_BUFSZ], out[STREAM_BUFSZ];
+	z_stream	 z;
+	ssize_t		 ssz;
+	size_t		 sz;
+	int		 live = 1, rc = Z_OK, flush = Z_NO_FLUSH;
+
+	memset(&z, 0, sizeof(z_stream));
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION,
+	    Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s: deflateInit2", sys->resource);
+		return 0;
+	}
+
+	do {
+		if ((ssz = read(fd, in, sizeof(in))) == -1) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: read", sys->resource);
+			break;
+		}
+		if (ssz == 0)
+			flush = Z_FINISH;
+		z.next_in = (Bytef *)in;
+		z.avail_in = ssz;
+		do {
+			z.next_out = (Bytef *)out;
+			z.avail_out = sizeof(out);
+			rc = deflate(&z, flush);
+			assert(rc != Z_STREAM_ERROR);
+			sz = sizeof(out) - z.avail_out;
+			if (live && sz > 0 &&
+			    khttp_write(&sys->req, out, sz) != KCGI_OK)
+				live = 0;
+			if (tfd != -1 && ! write_all(tfd, out, sz)) {
+				kutil_warn(&sys->req, sys->curuser,
+					"%s: sidecar write",
+					sys->resource);
+				tfd = -1;
+			}
+		} while (z.avail_out == 0);
+		if ( ! live && tfd == -1)
+			break;
+	} while (flush != Z_FINISH);
+
+	deflateEnd(&z);
+	return tfd != -1 && flush == Z_FINISH && rc == Z_STREAM_END;
+}
+
+/*
+ * Whether the sidecar "gst" is of the file "st" as it is now: it's
+ * stamped with the file's mtime when written.
+ */
+static int
+gzip_fresh(const struct stat *st, const struct stat *gst)
+{
+
+	return gst->st_size > 0 &&
+		gst->st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		gst->st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Describe the gzip encoding of the file "st" for a HEAD request.
+ * Its length is only known if there's a fresh sidecar; otherwise, it's
+ * left out, as the body would be sent without one.
+ */
+static void
+get_file_gzip_head(struct sys *sys,
+	const struct stat *st, const char *etag)
+{
+	int		 dfd, gfd;
+	struct stat	 gst;
+	char		 name[64];
+
+	gzip_sidecar(st, name, sizeof(name));
+
+	khttp_head(&sys->req, kresps[KRESP_CONTENT_ENCODING], "gzip");
+	http_head_cache(&sys->req, etag, st->st_mtim.tv_sec);
+
+	if ((dfd = open(GZIPDIR, O_RDONLY|O_DIRECTORY, 0)) != -1) {
+		if ((gfd = openat(dfd, name, O_RDONLY, 0)) != -1) {
+			if (fstat(gfd, &gst) != -1 && gzip_fresh(st, &gst))
+				khttp_head(&sys->req,
+					kresps[KRESP_CONTENT_LENGTH],
+					"%" PRId64, (int64_t)gst.st_size);
+			close(gfd);
+		}
+		close(dfd);
+	}
+
+	http_head_type(&sys->req, KHTTP_200, http_mime(&sys->req));
+	khttp_body_compress(&sys->req, 0);
+}
+
+/*
+ * Send the gzip encoding of the open file "fd".
+ * Use the sidecar under GZIPDIR if it's fresh (see gzip_fresh());
+ * otherwise, compress on the fly and replace the sidecar with the
+ * result.
+ */
+static void
+get_file_gzip(struct sys *sys, int fd,
+	const struct stat *st, const char *etag)
+{
+	int		 dfd, gfd, tfd = -1;
+	struct stat	 gst;
+	char		 name[64], tmp[80];
+	struct timespec	 ts[2];
+
+	gzip_sidecar(st, name, sizeof(name));
+
+	khttp_head(&sys->req, kresps[KRESP_CONTENT_ENCODING], "gzip");
+	http_head_cache(&sys->req, etag, st->st_mtim.tv_sec);
+
+	if ((dfd = open_dir(sys, GZIPDIR)) != -1 &&
+	    (gfd = openat(dfd, name, O_RDONLY, 0)) != -1) {
+		if (fstat(gfd, &gst) != -1 && gzip_fresh(st, &gst)) {
+			if (pledge("stdio", NULL) == -1)
+				kutil_err(&sys->req, sys->curuser,
+					"pledge");
+			khttp_head(&sys->req,
+				kresps[KRESP_CONTENT_LENGTH],
+				"%" PRId64, (int64_t)gst.st_size);
+			http_head_type(&sys->req, KHTTP_200,
+				http_mime(&sys->req));
+			khttp_body_compress(&sys->req, 0);
+			send_range(sys, gfd, 0, gst.st_size - 1);
+			close(gfd);
+			close(dfd);
+			return;
+		}
+		close(gfd);
+	}
+
+	/* Stale or missing: compress into a new temporary sidecar. */
+
+	if (dfd != -1) {
+		snprintf(tmp, sizeof(tmp), ".%s.%08" PRIx32,
+			name, arc4random());
+		tfd = openat(dfd, tmp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+		if (tfd == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: openat", GZIPDIR, tmp);
+	}
+
+	if (pledge(tfd == -1 ? "stdio" : "stdio fattr cpath", NULL) == -1)
+		kutil_err(&sys->req, sys->curuser, "pledge");
+
+	http_head_type(&sys->req, KHTTP_200, http_mime(&sys->req));
+	khttp_body_compress(&sys->req, 0);
+
+	if (gzip_stream(sys, fd, tfd)) {
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1] = st->st_mtim;
+		if (futimens(tfd, ts) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: futimens", GZIPDIR, tmp);
+		else if (renameat(dfd, tmp, dfd, name) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: renameat", GZIPDIR, tmp);
+		else
+			tmp[0] = '\0';
+	}
+
+	if (tfd != -1) {
+		if (tmp[0] != '\0' && unlinkat(dfd, tmp, 0) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: unlinkat", GZIPDIR, tmp);
+		close(tfd);
 	}
+	if (dfd != -1)
+		close(dfd);
+}
 
-	free(fpath);
-	for (i = 0; i < filesz; i++) {
-		free(files[i].name);
-		free(files[i].fullname);
+#ifdef OFFLOAD_HEADER
+/*
+ * Have the front-end web server send the file.
+ * Authorisation and path checks have already been made, so all that's
+ * left is telling the server where to find the file.
+ * It takes care of ranges, conditionals, and so on.
+ */
+static void
+get_file_offload(struct sys *sys)
+{
+	char		*buf, *cp;
+	const char	*rp;
+	size_t		 sz;
+
+	sz = strlen(OFFLOAD_PREFIX) + 2 + strlen(sys->resource) * 3;
+	buf = kmalloc(sz);
+	cp = buf + strlcpy(buf, OFFLOAD_PREFIX "/", sz);
+
+	for (rp = sys->resource; *rp != '\0'; rp++) {
+#ifdef OFFLOAD_PATH
+		if (iscntrl((unsigned char)*rp)) {
+			errorpage(sys, "Path security violation.");
+			free(buf);
+			return;
+		}
+		*cp++ = *rp;
+#else
+		if (isalnum((unsigned char)*rp) ||
+		    strchr("-._~/", *rp) != NULL)
+			*cp++ = *rp;
+		else
+			cp += snprintf(cp, 4, "%%%02X",
+				(unsigned char)*rp);
+#endif
 	}
-	free(files);
+	*cp = '\0';
+
+	khttp_head(&sys->req, OFFLOAD_HEADER, "%s", buf);
+	http_head_type(&sys->req, KHTTP_200, http_mime(&sys->req));
+	khttp_body_compress(&sys->req, 0);
+	kutil_info(&sys->req, sys->curuser,
+		"%s: offloaded", sys->resource);
+	free(buf);
 }
+#endif
 
 /*
  * Grok a file.
- * All we do use is the template feature to print out.
+ * If the request has a "Range" header, send only those parts.
+ * If the client accepts gzip and the file is textual, send it
+ * compressed.
+ * Otherwise, stream the whole file with its exact length.
  */
 static void
 get_file(struct sys *sys, const struct stat *st)
 {
-	int		  nfd;
+	int		  nfd, gz = 0;
+	char		  etag[64];
+	struct stat	  fst;
 
 	if ( ! S_ISREG(st->st_mode)) {
 		errorpage(sys, "Cannot open \"%s\".", sys->resource);
 		return;
 	}
 
-	nfd = openat(sys->filefd, sys->resource, O_RDONLY, 0);
+#ifdef OFFLOAD_HEADER
+	if (pledge("stdio", NULL) == -1)
+		kutil_err(&sys->req, sys->curuser, "pledge");
+	get_file_offload(sys);
+	return;
+#endif
+
+	/*
+	 * Uploads replace files by renaming over them, so the file we
+	 * open may not be the one stat'd by the caller: describe what we
+	 * actually send.
+	 * (Don't block opening anything other than a regular file.)
+	 */
+
+	nfd = openat(sys->filefd, sys->resource, O_RDONLY|O_NONBLOCK, 0);
 	if (-1 == nfd) {
 		kutil_warn(&sys->req, sys->curuser,
 			"%s: openat", sys->resource);
 		errorpage(sys, "Cannot open \"%s\".", sys->resource);
 		return;
-	} else if (-1 == pledge("stdio", NULL))
-		kutil_err(&sys->req, sys->curuser,
-			"%s", sys->resource);
+	} else if (fstat(nfd, &fst) == -1 || ! S_ISREG(fst.st_mode)) {
+		errorpage(sys, "Cannot open \"%s\".", sys->resource);
+		close(nfd);
+		return;
+	}
+	st = &fst;
 
 	/*
-	 * FIXME: use last-updated with the struct state of the
-	 * file and cross-check.
-	 * FIXME: range headers.
-	 * FIXME: KMETHOD_HEAD.
+	 * Ranges refer to the identity encoding, so only compress full
+	 * responses.
+	 * HEAD describes just what GET would send.
 	 */
 
-	http_open(&sys->req, KHTTP_200);
-	khttp_template_fd(&sys->req, NULL, nfd, sys->resource);
+	if (mime_compressible(http_mime(&sys->req))) {
+		khttp_head(&sys->req, kresps[KRESP_VARY],
+			"Accept-Encoding");
+		gz = sys->req.reqmap[KREQU_RANGE] == NULL &&
+			st->st_size >= GZIP_MINSZ &&
+			http_accept_gzip(&sys->req);
+	}
+
+	/* Only a compressed GET writes anything: its sidecar. */
+
+	if (pledge(gz && sys->req.method == KMETHOD_GET ?
+	    "stdio rpath cpath wpath fattr" : "stdio rpath", NULL) == -1)
+		kutil_err(&sys->req, sys->curuser, "pledge");
+
+	etag_file(st, gz, etag, sizeof(etag));
+	if (http_not_modified(&sys->req, etag, st->st_mtim.tv_sec)) {
+		close(nfd);
+		return;
+	}
+
+	/*
+	 * HEAD: everything we need is in the stat (and, if compressed,
+	 * the sidecar's), so don't read the file.
+	 * Disable kcgi's compression, which would make the length wrong.
+	 */
+
+	if (sys->req.method == KMETHOD_HEAD && gz) {
+		get_file_gzip_head(sys, st, etag);
+		close(nfd);
+		return;
+	} else if (sys->req.method == KMETHOD_HEAD) {
+		khttp_head(&sys->req, kresps[KRESP_ACCEPT_RANGES], "bytes");
+		khttp_head(&sys->req, kresps[KRESP_CONTENT_LENGTH],
+			"%" PRId64, (int64_t)st->st_size);
+		http_head_cache(&sys->req, etag, st->st_mtim.tv_sec);
+		http_head_type(&sys->req, KHTTP_200,
+			http_mime(&sys->req));
+		khttp_body_compress(&sys->req, 0);
+		close(nfd);
+		return;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(nfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if (gz) {
+		get_file_gzip(sys, nfd, st, etag);
+		close(nfd);
+		return;
+	}
+
+	if (-1 == pledge("stdio", NULL))
+		kutil_err(&sys->req, sys->curuser,
+			"%s", sys->resource);
+
+	if (sys->req.reqmap[KREQU_RANGE] != NULL &&
+	    get_file_range(sys, nfd, st, etag)) {
+		close(nfd);
+		return;
+	}
+
+	khttp_head(&sys->req, kresps[KRESP_ACCEPT_RANGES], "bytes");
+	khttp_head(&sys->req, kresps[KRESP_CONTENT_LENGTH],
+		"%" PRId64, (int64_t)st->st_size);
+	http_head_cache(&sys->req, etag, st->st_mtim.tv_sec);
+	http_head_type(&sys->req, KHTTP_200, http_mime(&sys->req));
+	khttp_body_compress(&sys->req, 0);
+	send_range(sys, nfd, 0, st->st_size - 1);
 	close(nfd);
 }
 
@@ -876,14 +2492,37 @@ send_301(struct sys *sys)
 static void
 post_op_rmfile(struct sys *sys, int nfd, const char *fn)
 {
+	struct stat	 st;
+	int		 hasst, rc;
+	struct dirtx	*tx;
+
+	/* Remember the inode so we can drop its sidecar and blob. */
+
+	hasst = fstatat(nfd, fn, &st, AT_SYMLINK_NOFOLLOW) != -1 &&
+		S_ISREG(st.st_mode);
+#ifdef DEDUP
+	if (hasst)
+		dedup_unref(sys, nfd, fn, &st);
+#endif
+
+	tx = dircache_begin(sys, nfd, ".");
+	rc = unlinkat(nfd, fn, 0);
+	dircache_commit(tx, rc == 0 ? fn : NULL);
 
-	if (-1 == unlinkat(nfd, fn, 0) && ENOENT != errno) {
+	if (-1 == rc && ENOENT != errno) {
 		kutil_warn(&sys->req, sys->curuser,
 			"%s/%s: unlinkat", sys->resource, fn);
 		errorpage(sys, "Cannot remove \"%s\".", fn);
 	} else {
 		kutil_info(&sys->req, sys->curuser,
 			"%s/%s: unlink", sys->resource, fn);
+		if (hasst && rc == 0 && fn[0] != '.') {
+			dirsum_adjust(sys, sys->resource,
+				-st.st_size, -1, 0);
+			search_remove(sys, sys->resource, fn, 0);
+		}
+		if (hasst)
+			gzip_remove(sys, &st);
 		send_301(sys);
 	}
 }
@@ -895,8 +2534,10 @@ post_op_rmfile(struct sys *sys, int nfd, const char *fn)
 static void
 post_op_rmdir(struct sys *sys)
 {
-	char	*newpath, *cp;
-	int	 rc;
+	char		*newpath, *cp;
+	const char	*base;
+	int		 rc;
+	struct dirtx	*tx;
 
 	if ('\0' == sys->resource[0]) {
 		kutil_warn(&sys->req, sys->curuser,
@@ -905,7 +2546,20 @@ post_op_rmdir(struct sys *sys)
 		return;
 	}
 
+	newpath = kstrdup(sys->resource);
+	/* Strip to path above. */
+	if (NULL != (cp = strrchr(newpath, '/'))) {
+		*cp = '\0';
+		base = cp + 1;
+	} else {
+		newpath[0] = '\0';
+		base = sys->resource;
+	}
+
+	tx = dircache_begin(sys, sys->filefd,
+		'\0' != newpath[0] ? newpath : ".");
 	rc = unlinkat(sys->filefd, sys->resource, AT_REMOVEDIR);
+	dircache_commit(tx, 0 == rc ? base : NULL);
 
 	if (-1 == rc && ENOENT != errno) {
 		kutil_warn(&sys->req, sys->curuser,
@@ -914,49 +2568,140 @@ post_op_rmdir(struct sys *sys)
 	} else {
 		kutil_info(&sys->req, sys->curuser,
 			"%s: unlink (dir)", sys->resource);
-		newpath = kstrdup(sys->resource);
-		/* Strip to path above. */
-		if (NULL != (cp = strrchr(newpath, '/')))
-			*cp = '\0';
-		else
-			newpath[0] = '\0';
+		if (0 == rc) {
+			dirsum_rmdir(sys, newpath, sys->resource);
+			search_remove(sys, "", sys->resource, 1);
+		}
 		send_301_path(sys, newpath);
-		free(newpath);
 	}
+	free(newpath);
 }
 
-#if 0
+/*
+ * Stream an archive of directory "sys->resource" to the client: either
+ * a ZIP of its regular files (ACTION_GETZIP) or a tar of its whole
+ * subtree (ACTION_GETTAR).
+ * Nothing is staged on disk: see zip_stream() and tar_stream().
+ */
 static void
-post_op_getzip(struct sys *sys, int nfd)
+get_archive(struct sys *sys, enum action act)
 {
-	char		*fname, *url;
+	int		 nfd;
 	char		 date[30];
-	const char	*cp;
+	char		*url, *cp;
+	const char	*name;
+
+	if (sys->resource[0] != '\0')
+		nfd = openat(sys->filefd, sys->resource,
+			O_RDONLY | O_DIRECTORY, 0);
+	else
+		nfd = dup(sys->filefd);
+
+	if (nfd == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s: openat", sys->resource);
+		errorpage(sys, "Cannot open \"%s\".", sys->resource);
+		return;
+	}
 
 	kutil_epoch2utcstr(time(NULL), date, sizeof(date));
 
-	cp = strrchr(sys->resource, '/');
-	if (NULL == cp)
-		cp = sys->resource;
+	if ((name = strrchr(sys->resource, '/')) != NULL)
+		name++;
+	else if (sys->resource[0] != '\0')
+		name = sys->resource;
 	else
-		cp++;
+		name = "httpdrop";
 
-	kasprintf(&url, "%s.%s.zip", cp, date);
+	/* Keep the file name safe within its quotes. */
 
-	if (NULL == (fname = zip_create(sys, nfd))) {
-		errorpage(sys, "System error.");
-		return;
-	}
+	kasprintf(&url, "%s.%s.%s", name, date,
+		act == ACTION_GETTAR ? "tar" : "zip");
+	for (cp = url; *cp != '\0'; cp++)
+		if (*cp == '"' || *cp == '\\' ||
+		    iscntrl((unsigned char)*cp))
+			*cp = '_';
 
 	khttp_head(&sys->req, kresps[KRESP_CONTENT_DISPOSITION],
 		"attachment; filename=\"%s\"", url);
-	http_open_mime(&sys->req, KHTTP_200, KMIME_APP_ZIP);
-	khttp_template(&sys->req, NULL, fname);
-	remove(fname);
-	free(fname);
+	http_head_type(&sys->req, KHTTP_200, act == ACTION_GETTAR ?
+		"application/x-tar" : kmimetypes[KMIME_APP_ZIP]);
+	khttp_body_compress(&sys->req, 0);
+
+	if (sys->req.method != KMETHOD_HEAD && act == ACTION_GETTAR)
+		tar_stream(sys, nfd, name);
+	else if (sys->req.method != KMETHOD_HEAD)
+		zip_stream(sys, nfd);
+
 	free(url);
+	close(nfd);
+}
+
+/*
+ * Emit one search result.
+ * This is a search_fn.
+ */
+static void
+get_search_result(const char *path, void *arg)
+{
+	struct kjsonreq	*req = arg;
+	char		 buf[PATH_MAX];
+	size_t		 sz;
+	int		 isdir;
+
+	if (strlcpy(buf, path, sizeof(buf)) >= sizeof(buf))
+		return;
+	sz = strlen(buf);
+	if ((isdir = sz > 0 && buf[sz - 1] == '/'))
+		buf[sz - 1] = '\0';
+
+	kjson_obj_open(req);
+	kjson_putstringp(req, "path", buf);
+	kjson_putstringp(req, "type", isdir ? "dir" : "file");
+	kjson_obj_close(req);
+}
+
+/*
+ * Search for paths under directory "sys->resource" containing the
+ * query, returning at most "count" of them as JSON.
+ * Paths are relative to the root, and "complete" is false if the index
+ * is still being built, so only recent changes were searched.
+ * See search_find().
+ */
+static void
+get_search(struct sys *sys)
+{
+	struct kjsonreq	 req;
+	const struct kpair *kp;
+	size_t		 max = LIST_PAGESZ;
+	int		 rc;
+
+	if (sys->req.fieldmap[KEY_QUERY] == NULL) {
+		errorpage(sys, "No search query.");
+		return;
+	}
+	if ((kp = sys->req.fieldmap[KEY_COUNT]) != NULL && kp->parsed.i > 0)
+		max = kp->parsed.i > LIST_PAGEMAX ?
+			LIST_PAGEMAX : kp->parsed.i;
+
+	http_open_mime(&sys->req, KHTTP_200, KMIME_APP_JSON);
+	if (sys->req.method == KMETHOD_HEAD)
+		return;
+
+	kjson_open(&req, &sys->req);
+	kjson_obj_open(&req);
+	kjson_putstringp(&req, "path", sys->resource);
+	kjson_putstringp(&req, "query",
+		sys->req.fieldmap[KEY_QUERY]->parsed.s);
+	kjson_arrayp_open(&req, "results");
+	rc = search_find(sys, sys->resource,
+		sys->req.fieldmap[KEY_QUERY]->parsed.s,
+		max, get_search_result, &req);
+	kjson_array_close(&req);
+	kjson_putboolp(&req, "complete", rc > 0);
+	kjson_obj_close(&req);
+	kjson_close(&req);
 }
-#endif
 
 /*
  * Make a directory "pn" relative to the current path "path" with file
@@ -965,30 +2710,274 @@ post_op_getzip(struct sys *sys, int nfd)
 static void
 post_op_mkdir(struct sys *sys, int nfd, const char *pn)
 {
+	char		*path;
+	int		 rc;
+	struct dirtx	*tx;
+
+	tx = dircache_begin(sys, nfd, ".");
+	rc = mkdirat(nfd, pn, 0700);
+	dircache_commit(tx, 0 == rc ? pn : NULL);
 
-	if (-1 == mkdirat(nfd, pn, 0700) && EEXIST != errno) {
+	if (-1 == rc && EEXIST != errno) {
 		kutil_warn(&sys->req, sys->curuser,
 			"%s/%s: mkdirat", sys->resource, pn);
 		errorpage(sys, "Cannot create \"%s\".", pn);
 	} else {
 		kutil_info(&sys->req, sys->curuser,
 			"%s/%s: created", sys->resource, pn);
+		if (0 == rc) {
+			kasprintf(&path, "%s%s%s", sys->resource,
+				'\0' != sys->resource[0] ? "/" : "", pn);
+			dirsum_mkdir(sys, sys->resource, path);
+			search_add(sys, sys->resource, pn, 1);
+			free(path);
+		}
 		send_301(sys);
 	}
 }
 
+/*
+ * Respond with the state of a chunked upload session "p".
+ * If "have" is not NULL, it's the map of received chunks.
+ */
+static void
+upsess_json(struct sys *sys, const struct upsess *p, const char *have)
+{
+	struct kjsonreq	 req;
+
+	http_open_mime(&sys->req, KHTTP_200, KMIME_APP_JSON);
+	kjson_open(&req, &sys->req);
+	kjson_obj_open(&req);
+	kjson_putstringp(&req, "id", p->id);
+	kjson_putintp(&req, "size", p->size);
+	kjson_putintp(&req, "chunk", UPLOAD_CHUNKSZ);
+	kjson_putintp(&req, "chunks", p->chunks);
+	if (have != NULL)
+		kjson_putstringp(&req, "have", have);
+	kjson_obj_close(&req);
+	kjson_close(&req);
+}
+
+/*
+ * A step of a resumable, chunked upload, which is driven by the client
+ * (see httpdrop.js):
+ *   "init" with "filename" and "size" starts a session;
+ *   "status" with "upid" lists which chunks have been received;
+ *   "chunk" with "upid", "chunk" index, and "file" data stores one;
+ *   "commit" with "upid" moves the completed file into place.
+ * The "init" and "status" steps respond with JSON.
+ * Errors are 400 (bad request), 404 (no session), 409 (incomplete on
+ * commit), 413 (too large on init), or 500 (system error).
+ */
+static void
+post_op_mkfile_chunk(struct sys *sys, int nfd)
+{
+	const char	*step = sys->req.fieldmap[KEY_STEP]->parsed.s;
+	struct kpair	*kp;
+	struct upsess	 us;
+	char		*have;
+	int		 updfd, rc;
+
+	memset(&us, 0, sizeof(struct upsess));
+
+	if ((updfd = open_dir(sys, UPLOADDIR)) == -1) {
+		http_open(&sys->req, KHTTP_500);
+		return;
+	}
+
+	if (strcmp(step, "init") == 0) {
+		if ((kp = sys->req.fieldmap[KEY_FILENAME]) == NULL ||
+		    sys->req.fieldmap[KEY_SIZE] == NULL) {
+			http_open(&sys->req, KHTTP_400);
+		} else if (strchr(kp->parsed.s, '/') != NULL ||
+		    kp->parsed.s[0] == '.') {
+			kutil_warnx(&sys->req, sys->curuser,
+				"%s/%s: filename security violation",
+				sys->resource, kp->parsed.s);
+			http_open(&sys->req, KHTTP_400);
+		} else if ((rc = upsess_create(sys, updfd, kp->parsed.s,
+		    sys->req.fieldmap[KEY_SIZE]->parsed.i, &us)) <= 0)
+			http_open(&sys->req,
+				rc < 0 ? KHTTP_500 : KHTTP_413);
+		else
+			upsess_json(sys, &us, NULL);
+		goto out;
+	}
+
+	if (sys->req.fieldmap[KEY_UPID] == NULL) {
+		http_open(&sys->req, KHTTP_400);
+		goto out;
+	}
+
+	rc = upsess_open(sys, updfd,
+		sys->req.fieldmap[KEY_UPID]->parsed.s, &us);
+	if (rc <= 0) {
+		http_open(&sys->req, rc < 0 ? KHTTP_500 : KHTTP_404);
+		goto out;
+	}
+
+	if (strcmp(step, "status") == 0) {
+		if ((have = upsess_have(sys, updfd, &us)) == NULL) {
+			http_open(&sys->req, KHTTP_500);
+			goto out;
+		}
+		upsess_json(sys, &us, have);
+		free(have);
+	} else if (strcmp(step, "chunk") == 0) {
+		if ((kp = sys->req.fieldmap[KEY_FILE]) == NULL ||
+		    sys->req.fieldmap[KEY_CHUNK] == NULL) {
+			http_open(&sys->req, KHTTP_400);
+			goto out;
+		}
+		rc = upsess_write(sys, updfd, &us,
+			sys->req.fieldmap[KEY_CHUNK]->parsed.i,
+			kp->val, kp->valsz);
+		http_open(&sys->req, rc < 0 ? KHTTP_500 :
+			rc == 0 ? KHTTP_400 : KHTTP_200);
+	} else if (strcmp(step, "commit") == 0) {
+		rc = upsess_commit(sys, updfd, &us, nfd);
+		http_open(&sys->req, rc < 0 ? KHTTP_500 :
+			rc == 0 ? KHTTP_409 : KHTTP_200);
+	} else
+		http_open(&sys->req, KHTTP_400);
+out:
+	upsess_free(&us);
+	close(updfd);
+}
+
+/*
+ * Write one uploaded file "kp" into the directory "nfd".
+ * It's written into a staging file and renamed into place, so readers
+ * never see a partial file.
+ * This also bumps the directory's mtime, which validates its listing,
+ * even when replacing an existing file.
+ * Returns zero on failure (which is logged), non-zero on success.
+ */
+static int
+mkfile_one(const struct sys *sys, int nfd, const struct kpair *kp)
+{
+	int	 	 dfd;
+	ssize_t	 	 ssz;
+	char		 tmp[32];
+	const char	*hp = NULL;
+#ifdef DEDUP
+	char		 hex[SHA256_DIGEST_STRING_LENGTH];
+	struct stage	 stg;
+
+	/* Known content needn't be written at all. */
+
+	hp = SHA256Data((uint8_t *)kp->val, kp->valsz, hex);
+	stage_begin(sys, nfd, kp->file, &stg);
+	if (dedup_link(sys, nfd, kp->file, hp, kp->valsz) > 0) {
+		stage_done(sys, nfd, kp->file, &stg, 1);
+		kutil_info(&sys->req, sys->curuser,
+			"%s/%s: linked %zu bytes",
+			sys->resource, kp->file, kp->valsz);
+		return 1;
+	}
+	stage_done(sys, nfd, kp->file, &stg, 0);
+#endif
+	if (-1 == (dfd = stage_open(sys, nfd,
+	    kp->file, tmp, sizeof(tmp))))
+		return 0;
+
+	if ((ssz = write(dfd, kp->val, kp->valsz)) < 0) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: write", sys->resource, kp->file);
+		stage_close(sys, nfd, dfd, tmp, kp->file, 0, NULL);
+		return 0;
+	} else if ((size_t)ssz < kp->valsz) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: short write", sys->resource, kp->file);
+		stage_close(sys, nfd, dfd, tmp, kp->file, 0, NULL);
+		return 0;
+	} else if ( ! stage_close(sys, nfd, dfd, tmp, kp->file, 1, hp))
+		return 0;
+
+	kutil_info(&sys->req, sys->curuser,
+		"%s/%s: wrote %zu bytes",
+		sys->resource, kp->file, kp->valsz);
+	return 1;
+}
+
+/*
+ * Files of a single upload shared among the writer threads.
+ */
+struct	mkfiles {
+	const struct sys *sys;
+	int		  nfd; /* target directory */
+	struct kpair	 *next; /* next file to write */
+	int		  failed; /* any file failed? */
+	pthread_mutex_t	  mtx; /* protects next and failed */
+};
+
+/*
+ * Writer thread: take files until there are none left.
+ */
+static void *
+mkfile_worker(void *arg)
+{
+	struct mkfiles		*p = arg;
+	const struct kpair	*kp;
+	int			 rc;
+
+	for (;;) {
+		pthread_mutex_lock(&p->mtx);
+		if ((kp = p->next) != NULL)
+			p->next = p->next->next;
+		pthread_mutex_unlock(&p->mtx);
+		if (kp == NULL)
+			break;
+		rc = mkfile_one(p->sys, p->nfd, kp);
+		pthread_mutex_lock(&p->mtx);
+		if ( ! rc)
+			p->failed = 1;
+		pthread_mutex_unlock(&p->mtx);
+	}
+
+	return NULL;
+}
+
 /*
  * Write all files named within the "KEY_FILE" designation.
  * Use file contents "data" of size "sz".
+ * Files are written in parallel by up to WRITEJOBS threads, so the
+ * open and write latency of each isn't paid in sequence.
+ * If the upload is being streamed (see upload_stream_init()), the
+ * files are instead written as they're read from the request body,
+ * each published while the next is read.
  * FIXME: have this perform after closing the connection, else it might
  * block the connection.
  */
 static void
 post_op_mkfile(struct sys *sys, int nfd)
 {
-	int	 	 dfd, fl = O_WRONLY|O_TRUNC|O_CREAT;
-	ssize_t	 	 ssz;
+	int		 rc;
+	size_t		 i, jobs = 0;
 	struct kpair	*kp;
+	struct mkfiles	 mk;
+	pthread_t	 thr[WRITEJOBS];
+
+	if (sys->req.fieldmap[KEY_STEP] != NULL) {
+		post_op_mkfile_chunk(sys, nfd);
+		return;
+	}
+
+	/* Streamed uploads were never seen by kcgi. */
+
+	if (sys->upload >= 0) {
+		rc = upload_stream(sys, nfd,
+			sys->upload, keys[KEY_FILE].name);
+		if (rc < 0) {
+			errorpage(sys, "Filename security violation.");
+			return;
+		} else if (rc == 0) {
+			errorpage(sys, "System error.");
+			return;
+		}
+		send_301(sys);
+		return;
+	}
 
 	for (kp = sys->req.fieldmap[KEY_FILE]; NULL != kp; kp = kp->next)
 		if ('\0' == kp->file[0] ||
@@ -998,37 +2987,43 @@ post_op_mkfile(struct sys *sys, int nfd)
 			return;
 		}
 
-	for (kp = sys->req.fieldmap[KEY_FILE]; NULL != kp; kp = kp->next) {
-		if (-1 == (dfd = openat(nfd, kp->file, fl, 0600))) {
-			kutil_warn(&sys->req, sys->curuser,
-				"%s/%s: openat", sys->resource,
-				kp->file);
-			errorpage(sys, "System error.");
-			return;
-		}
-		if ((ssz = write(dfd, kp->val, kp->valsz)) < 0) {
-			kutil_warn(&sys->req, sys->curuser,
-				"%s/%s: write", sys->resource,
-				kp->file);
-			errorpage(sys, "System error.");
-			close(dfd);
-			return;
-		} else if ((size_t)ssz < kp->valsz) {
+	/* Nothing to write (e.g., no file chosen). */
+
+	if (sys->req.fieldmap[KEY_FILE] == NULL) {
+		send_301(sys);
+		return;
+	}
+
+	memset(&mk, 0, sizeof(struct mkfiles));
+	mk.sys = sys;
+	mk.nfd = nfd;
+	mk.next = sys->req.fieldmap[KEY_FILE];
+	pthread_mutex_init(&mk.mtx, NULL);
+
+	/*
+	 * Start at most one thread per file beyond the first, which we
+	 * write ourselves.
+	 * If threads can't be started, we'll just do more of the work.
+	 */
+
+	for (kp = mk.next->next; kp != NULL && jobs < WRITEJOBS - 1;
+	     kp = kp->next, jobs++)
+		if ((rc = pthread_create(&thr[jobs],
+		    NULL, mkfile_worker, &mk)) != 0) {
 			kutil_warnx(&sys->req, sys->curuser,
-				"%s/%s: short write",
-				sys->resource, kp->file);
-			errorpage(sys, "System error.");
-			close(dfd);
-			return;
-		} else {
-			kutil_info(&sys->req, sys->curuser,
-				"%s/%s: wrote %zu bytes",
-				sys->resource, kp->file, kp->valsz);
+				"pthread_create: %s", strerror(rc));
+			break;
 		}
-		close(dfd);
-	}
 
-	send_301(sys);
+	mkfile_worker(&mk);
+	for (i = 0; i < jobs; i++)
+		pthread_join(thr[i], NULL);
+	pthread_mutex_destroy(&mk.mtx);
+
+	if (mk.failed)
+		errorpage(sys, "System error.");
+	else
+		send_301(sys);
 }
 
 /*
@@ -1044,7 +3039,8 @@ post_op_file(struct sys *sys, enum action act)
 
 	/* Start with validation. */
 
-	if (ACTION_MKFILE == act &&
+	if (ACTION_MKFILE == act && sys->upload < 0 &&
+	    NULL == sys->req.fieldmap[KEY_STEP] &&
 	    (NULL == sys->req.fieldmap[KEY_FILE] ||
 	     '\0' == sys->req.fieldmap[KEY_FILE]->file[0])) {
 		send_301(sys);
@@ -1102,10 +3098,6 @@ post_op_file(struct sys *sys, enum action act)
 		post_op_rmdir(sys);
 	else if (ACTION_MKDIR == act)
 		post_op_mkdir(sys, nfd, target);
-#if 0
-	else if (ACTION_GETZIP == act)
-		post_op_getzip(sys, nfd);
-#endif
 out:
 	if (-1 != nfd)
 		close(nfd);
@@ -1331,6 +3323,13 @@ main(void)
 
 	kutil_openlog(LOGFILE);
 
+	/*
+	 * File uploads are streamed to disk by upload_stream(), so make
+	 * sure kcgi doesn't first read (and buffer) the whole body.
+	 */
+
+	sys.upload = upload_stream_init();
+
 	/*
 	 * Actually parse HTTP document.
 	 * Then drop privileges to only have file-system access.
@@ -1349,7 +3348,7 @@ main(void)
 	if (unveil(DATADIR, "r") == -1)
 		kutil_err(&sys.req, NULL, "unveil");
 
-	if (pledge("fattr flock rpath cpath wpath stdio", NULL) == -1)
+	if (pledge("fattr flock proc rpath cpath wpath stdio", NULL) == -1)
 		kutil_err(&sys.req, NULL, "pledge");
 
 	/*
@@ -1358,6 +3357,7 @@ main(void)
 	 */
 
 	if (sys.req.method != KMETHOD_GET &&
+	    sys.req.method != KMETHOD_HEAD &&
 	    sys.req.method != KMETHOD_POST) {
 		errorpage(&sys, "Invalid HTTP method.");
 		goto out;
@@ -1407,21 +3407,13 @@ main(void)
 	}
 	sys.authfd = fd;
 
-#if 0
-	if (-1 == (fd = open_dir(&sys, TMPDIR))) {
-		errorpage(&sys, "Cannot open tmpfile root.");
-		goto out;
-	}
-	sys.tmpfd = fd;
-#endif
-
 	/*
 	 * Now figure out what we're supposed to do here.
 	 * This will sanitise our request action.
 	 * Then switch on those actions.
 	 */
 
-	if (sys.req.method != KMETHOD_GET) {
+	if (sys.req.method == KMETHOD_POST) {
 		if ((kp = sys.req.fieldmap[KEY_OP]) == NULL)
 			act = ACTION__MAX;
 		else if (strcmp(kp->parsed.s, "chpass") == 0)
@@ -1438,11 +3430,14 @@ main(void)
 			act = ACTION_LOGIN;
 		else if (strcmp(kp->parsed.s, "logout") == 0)
 			act = ACTION_LOGOUT;
-#if 0
-		else if (0 == strcmp(kp->parsed.s, "getzip"))
-			act = ACTION_GETZIP;
-#endif
-	} else
+	} else if ((kp = sys.req.fieldmap[KEY_OP]) != NULL &&
+	    strcmp(kp->parsed.s, "getzip") == 0)
+		act = ACTION_GETZIP;
+	else if (kp != NULL && strcmp(kp->parsed.s, "gettar") == 0)
+		act = ACTION_GETTAR;
+	else if (kp != NULL && strcmp(kp->parsed.s, "search") == 0)
+		act = ACTION_SEARCH;
+	else
 		act = ACTION_GET;
 
 	if (act == ACTION__MAX) {
@@ -1450,10 +3445,29 @@ main(void)
 		goto out;
 	}
 
-	/* Getting (readonly): drop privileges. */
+	/*
+	 * Getting: drop privileges.
+	 * Listings write cached listings and totals; get_file() narrows
+	 * this at once to what it needs, i.e., writing its sidecar.
+	 * Listings and searches may fork to rebuild directory totals
+	 * or the search index.
+	 * Archives are only ever read, and posts never fork.
+	 */
 
 	if (act == ACTION_GET)
-		if (-1 == pledge("fattr flock rpath stdio", NULL))
+		if (-1 == pledge("fattr flock proc rpath "
+		    "cpath wpath stdio", NULL))
+			kutil_err(&sys.req, NULL, "pledge");
+	if (act == ACTION_GETZIP || act == ACTION_GETTAR)
+		if (-1 == pledge("rpath stdio", NULL))
+			kutil_err(&sys.req, NULL, "pledge");
+	if (act == ACTION_SEARCH)
+		if (-1 == pledge("flock proc rpath "
+		    "cpath wpath stdio", NULL))
+			kutil_err(&sys.req, NULL, "pledge");
+	if (sys.req.method == KMETHOD_POST)
+		if (-1 == pledge("fattr flock rpath "
+		    "cpath wpath stdio", NULL))
 			kutil_err(&sys.req, NULL, "pledge");
 
 	/* Logging in: jump straight to login page. */
@@ -1519,7 +3533,7 @@ main(void)
 	 * If that fails, look in our supplemental groups.
 	 */
 
-	if ((isw = check_canwrite(&st)) < 0) {
+	if ((isw = check_canwrite(st.st_mode, st.st_uid, st.st_gid)) < 0) {
 		kutil_warn(&sys.req, NULL, "getgroups");
 		errorpage(&sys, "System error.");
 		goto out;
@@ -1534,9 +3548,19 @@ main(void)
 
 	if (act == ACTION_GET) {
 		if (ftype == FTYPE_DIR)
-			get_dir(&sys, isw);
+			get_dir(&sys, &st, isw);
 		else
 			get_file(&sys, &st);
+	} else if (act == ACTION_GETZIP || act == ACTION_GETTAR) {
+		if (ftype != FTYPE_DIR)
+			errorpage(&sys, "Archive of a regular file.");
+		else
+			get_archive(&sys, act);
+	} else if (act == ACTION_SEARCH) {
+		if (ftype != FTYPE_DIR)
+			errorpage(&sys, "Search of a regular file.");
+		else
+			get_search(&sys);
 	} else {
 		if (ftype != FTYPE_DIR)
 			errorpage(&sys, "Post into a regular file.");
@@ -1556,9 +3580,6 @@ out:
 
 	close(sys.filefd);
 	close(sys.authfd);
-#if 0
-	close(sys.tmpfd);
-#endif
 
 	auth_file_free(&auth_arg);
 	khttp_free(&sys.req);
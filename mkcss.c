@@ -0,0 +1,412 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build-time tool: minify a style sheet, writing it to standard output.
+ * Comments are dropped, except notices (opening with "!"), and white
+ * space is cut to what's significant.
+ * If given files with -w, selectors naming a class that appears as a
+ * word in none of them are dropped too, then rules left with none.
+ * Classes within parentheses, as in ":not(.foo)", don't count.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Growable output buffer.
+ */
+struct	buf {
+	char	*p;
+	size_t	 sz;
+	size_t	 max;
+};
+
+static char	**words;
+static size_t	  wordsz;
+
+static void
+buf_putn(struct buf *b, const char *cp, size_t sz)
+{
+
+	if (b->sz + sz + 1 > b->max) {
+		b->max = (b->sz + sz + 1) * 2;
+		if ((b->p = realloc(b->p, b->max)) == NULL)
+			err(1, NULL);
+	}
+	memcpy(b->p + b->sz, cp, sz);
+	b->sz += sz;
+	b->p[b->sz] = '\0';
+}
+
+static void
+buf_putc(struct buf *b, char c)
+{
+
+	buf_putn(b, &c, 1);
+}
+
+/*
+ * Read all of "fn" into a NUL-terminated buffer.
+ */
+static char *
+readall(const char *fn, size_t *sz)
+{
+	FILE		*f;
+	struct buf	 b;
+	char		 in[BUFSIZ];
+	size_t		 ssz;
+
+	memset(&b, 0, sizeof(struct buf));
+	buf_putn(&b, "", 0);
+	if ((f = fopen(fn, "r")) == NULL)
+		err(1, "%s", fn);
+	while ((ssz = fread(in, 1, sizeof(in), f)) > 0)
+		buf_putn(&b, in, ssz);
+	if (ferror(f))
+		err(1, "%s", fn);
+	fclose(f);
+	*sz = b.sz;
+	return b.p;
+}
+
+static int
+isword(int c)
+{
+
+	return isalnum((unsigned char)c) || c == '-' || c == '_';
+}
+
+static int
+wordcmp(const void *p1, const void *p2)
+{
+
+	return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+/*
+ * Add every word (run of letters, digits, '-' and '_') of "fn" to the
+ * words that classes are looked up in.
+ */
+static void
+words_add(const char *fn)
+{
+	char	*text;
+	size_t	 sz, i, j;
+
+	text = readall(fn, &sz);
+	for (i = 0; i < sz; i = j) {
+		for (j = i; j < sz && isword(text[j]); j++)
+			continue;
+		if (j == i) {
+			j++;
+			continue;
+		}
+		words = reallocarray(words, wordsz + 1, sizeof(char *));
+		if (words == NULL ||
+		    (words[wordsz++] = strndup(&text[i], j - i)) == NULL)
+			err(1, NULL);
+	}
+	free(text);
+}
+
+static int
+words_have(const char *cp, size_t sz)
+{
+	char	 word[256];
+	char	*key = word;
+
+	if (sz >= sizeof(word))
+		return 1;
+	memcpy(word, cp, sz);
+	word[sz] = '\0';
+	return bsearch(&key, words, wordsz,
+		sizeof(char *), wordcmp) != NULL;
+}
+
+/*
+ * Length of the string starting with the quote at "cp".
+ */
+static size_t
+strlen_quoted(const char *cp, size_t sz)
+{
+	size_t	 i;
+
+	for (i = 1; i < sz && cp[i] != cp[0]; i++)
+		if (cp[i] == '\\' && i + 1 < sz)
+			i++;
+	return i < sz ? i + 1 : sz;
+}
+
+/*
+ * Strip comments, keeping notices in "notes", and squeeze runs of white
+ * space into a single space.
+ */
+static void
+normalise(const char *in, size_t sz, struct buf *out, struct buf *notes)
+{
+	size_t	 i, n;
+	const char *end;
+
+	for (i = 0; i < sz; ) {
+		if (in[i] == '"' || in[i] == '\'') {
+			n = strlen_quoted(&in[i], sz - i);
+			buf_putn(out, &in[i], n);
+			i += n;
+		} else if (in[i] == '/' && i + 1 < sz && in[i + 1] == '*') {
+			if ((end = strstr(&in[i + 2], "*/")) == NULL)
+				break;
+			n = end + 2 - &in[i];
+			if (i + 2 < sz && in[i + 2] == '!') {
+				buf_putn(notes, &in[i], n);
+				buf_putc(notes, '\n');
+			}
+			i += n;
+			if (out->sz && out->p[out->sz - 1] != ' ')
+				buf_putc(out, ' ');
+		} else if (isspace((unsigned char)in[i])) {
+			if (out->sz && out->p[out->sz - 1] != ' ')
+				buf_putc(out, ' ');
+			i++;
+		} else
+			buf_putc(out, in[i++]);
+	}
+}
+
+/*
+ * Copy "sz" bytes of normalised text, dropping spaces next to the
+ * characters of "tight", and a semicolon before a closing brace.
+ */
+static void
+squeeze(const char *in, size_t sz, const char *tight, struct buf *out)
+{
+	size_t	 i, n;
+
+	for (i = 0; i < sz; ) {
+		if (in[i] == '"' || in[i] == '\'') {
+			n = strlen_quoted(&in[i], sz - i);
+			buf_putn(out, &in[i], n);
+			i += n;
+			continue;
+		}
+		if (in[i] == ' ' && (out->sz == 0 ||
+		    i + 1 == sz || strchr(tight, in[i + 1]) != NULL ||
+		    strchr(tight, out->p[out->sz - 1]) != NULL)) {
+			i++;
+			continue;
+		}
+		if (in[i] == '}' && out->sz && out->p[out->sz - 1] == ';')
+			out->sz--;
+		buf_putc(out, in[i++]);
+	}
+	if (out->sz && out->p[out->sz - 1] == ';')
+		out->sz--;
+}
+
+/*
+ * Whether all classes of the selector "cp", outside of parentheses, are
+ * known words.
+ */
+static int
+selector_used(const char *cp, size_t sz)
+{
+	size_t	 i, j;
+	int	 depth = 0;
+
+	for (i = 0; i < sz; i++) {
+		if (cp[i] == '(')
+			depth++;
+		else if (cp[i] == ')')
+			depth--;
+		else if (cp[i] == '"' || cp[i] == '\'')
+			i += strlen_quoted(&cp[i], sz - i) - 1;
+		else if (cp[i] == '.' && depth == 0 &&
+		    i + 1 < sz && ! isdigit((unsigned char)cp[i + 1])) {
+			for (j = i + 1; j < sz && isword(cp[j]); j++)
+				continue;
+			if (j > i + 1 && ! words_have(&cp[i + 1], j - i - 1))
+				return 0;
+			i = j - 1;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Append those of the comma-separated selectors "cp" that are used.
+ */
+static void
+selectors(const char *cp, size_t sz, struct buf *out)
+{
+	size_t	 i, start, len;
+	int	 depth = 0, first = 1;
+
+	for (i = start = 0; i <= sz; i++) {
+		if (i < sz && (cp[i] == '"' || cp[i] == '\'')) {
+			i += strlen_quoted(&cp[i], sz - i) - 1;
+			continue;
+		}
+		if (i < sz && (cp[i] == '(' || cp[i] == '['))
+			depth++;
+		else if (i < sz && (cp[i] == ')' || cp[i] == ']'))
+			depth--;
+		if (i < sz && (cp[i] != ',' || depth > 0))
+			continue;
+		len = i - start;
+		if (wordsz == 0 || selector_used(&cp[start], len)) {
+			if ( ! first)
+				buf_putc(out, ',');
+			squeeze(&cp[start], len, ",>", out);
+			first = 0;
+		}
+		start = i + 1;
+	}
+}
+
+/*
+ * Offset of the first of "delims" in "cp", outside of strings and
+ * (if "nest") of nested braces, or "sz" if none.
+ */
+static size_t
+find(const char *cp, size_t sz, const char *delims, int nest)
+{
+	size_t	 i;
+	int	 depth = 0;
+
+	for (i = 0; i < sz; i++) {
+		if (cp[i] == '"' || cp[i] == '\'') {
+			i += strlen_quoted(&cp[i], sz - i) - 1;
+			continue;
+		}
+		if (depth == 0 && strchr(delims, cp[i]) != NULL)
+			break;
+		if (nest && cp[i] == '{')
+			depth++;
+		else if (nest && cp[i] == '}')
+			depth--;
+	}
+	return i;
+}
+
+/*
+ * Minify the rules of normalised text "cp" into "out".
+ * Conditional group rules (@media, @supports) are minified in turn and
+ * dropped if left empty; other at-rules are kept whole.
+ */
+static void
+rules(const char *cp, size_t sz, struct buf *out, int top)
+{
+	struct buf	 sel, inner;
+	size_t		 i, d, body, end;
+
+	for (i = 0; i < sz; ) {
+		while (i < sz && (cp[i] == ' ' || cp[i] == '}'))
+			i++;
+		if (i == sz)
+			break;
+
+		d = i + find(&cp[i], sz - i, "{;", 0);
+		if (d == sz || cp[d] == ';') {
+			squeeze(&cp[i], d - i, ",:;", out);
+			buf_putc(out, ';');
+			i = d + 1;
+			continue;
+		}
+
+		body = d + 1;
+		end = body + find(&cp[body], sz - body, "}", 1);
+
+		if (cp[i] == '@' && (strncmp(&cp[i], "@media", 6) == 0 ||
+		    strncmp(&cp[i], "@supports", 9) == 0)) {
+			memset(&inner, 0, sizeof(struct buf));
+			rules(&cp[body], end - body, &inner, 0);
+			if (inner.sz) {
+				squeeze(&cp[i], d - i, ",:", out);
+				buf_putc(out, '{');
+				buf_putn(out, inner.p, inner.sz);
+				buf_putc(out, '}');
+				if (top)
+					buf_putc(out, '\n');
+			}
+			free(inner.p);
+		} else if (cp[i] == '@') {
+			squeeze(&cp[i], end - i, "{},:;", out);
+			buf_putc(out, '}');
+			if (top)
+				buf_putc(out, '\n');
+		} else {
+			memset(&sel, 0, sizeof(struct buf));
+			selectors(&cp[i], d - i, &sel);
+			if (sel.sz) {
+				buf_putn(out, sel.p, sel.sz);
+				buf_putc(out, '{');
+				squeeze(&cp[body], end - body,
+					"{},:;", out);
+				buf_putc(out, '}');
+				if (top)
+					buf_putc(out, '\n');
+			}
+			free(sel.p);
+		}
+		i = end + 1;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct buf	 norm, notes, out;
+	char		*text;
+	size_t		 sz;
+	int		 c;
+
+	while ((c = getopt(argc, argv, "w:")) != -1)
+		switch (c) {
+		case 'w':
+			words_add(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		goto usage;
+
+	qsort(words, wordsz, sizeof(char *), wordcmp);
+
+	memset(&norm, 0, sizeof(struct buf));
+	memset(&notes, 0, sizeof(struct buf));
+	memset(&out, 0, sizeof(struct buf));
+
+	text = readall(argv[0], &sz);
+	normalise(text, sz, &norm, &notes);
+	rules(norm.p, norm.sz, &out, 1);
+
+	if (notes.sz)
+		fwrite(notes.p, 1, notes.sz, stdout);
+	if (out.sz)
+		fwrite(out.p, 1, out.sz, stdout);
+	return 0;
+usage:
+	fprintf(stderr, "usage: mkcss [-w words] style.css\n");
+	return 1;
+}
@@ -0,0 +1,194 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Build-time tool: compile the page templates given as arguments into
+ * C source, written to standard output, for linking into httpdrop.
+ * Each template's text is split at its @@KEY@@s into segments (see
+ * struct tmplseg), so it's sent without being scanned for keys.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Read all of "fn" into a NUL-terminated buffer.
+ */
+static char *
+readall(const char *fn, size_t *sz)
+{
+	FILE	*f;
+	char	*buf = NULL;
+	size_t	 bufsz = 0, len = 0, ssz;
+
+	if ((f = fopen(fn, "r")) == NULL)
+		err(1, "%s", fn);
+	for (;;) {
+		if (len + BUFSIZ + 1 > bufsz) {
+			bufsz = len + BUFSIZ + 1;
+			if ((buf = realloc(buf, bufsz)) == NULL)
+				err(1, NULL);
+		}
+		if ((ssz = fread(buf + len, 1, BUFSIZ, f)) == 0)
+			break;
+		len += ssz;
+	}
+	if (ferror(f))
+		err(1, "%s", fn);
+	fclose(f);
+	buf[len] = '\0';
+	*sz = len;
+	return buf;
+}
+
+/*
+ * If "cp" starts a key, @@ around letters, digits, or underscores,
+ * return the length of its name; otherwise, zero.
+ */
+static size_t
+keylen(const char *cp)
+{
+	size_t	 i;
+
+	if (cp[0] != '@' || cp[1] != '@')
+		return 0;
+	for (i = 2; isalnum((unsigned char)cp[i]) || cp[i] == '_'; i++)
+		continue;
+	if (i == 2 || cp[i] != '@' || cp[i + 1] != '@')
+		return 0;
+	return i - 2;
+}
+
+/*
+ * Emit "sz" bytes of "cp" as a C string literal, broken at newlines.
+ */
+static void
+putlit(const char *cp, size_t sz)
+{
+	size_t	 i;
+	int	 open = 0;
+
+	for (i = 0; i < sz; i++) {
+		if ( ! open) {
+			fputs("\t\"", stdout);
+			open = 1;
+		}
+		if (cp[i] == '\n')
+			fputs("\\n", stdout);
+		else if (cp[i] == '\t')
+			fputs("\\t", stdout);
+		else if (cp[i] == '"' || cp[i] == '\\')
+			printf("\\%c", cp[i]);
+		else if (cp[i] == '?' && i > 0 && cp[i - 1] == '?')
+			fputs("\\?", stdout);
+		else if (isprint((unsigned char)cp[i]))
+			putchar(cp[i]);
+		else
+			printf("\\%03o", (unsigned char)cp[i]);
+		if (cp[i] == '\n') {
+			fputs("\"\n", stdout);
+			open = 0;
+		}
+	}
+	if (open)
+		fputs("\"\n", stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char		*buf;
+	const char	*cp;
+	size_t		 sz, i, j, len, off, kl, *segs;
+	int		 n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: mktemplates template...\n");
+		return 1;
+	}
+
+	if ((segs = calloc(argc, sizeof(size_t))) == NULL)
+		err(1, NULL);
+
+	puts("/* Generated by mktemplates: do not edit. */\n"
+	     "#include <sys/queue.h>\n\n"
+	     "#include <stdint.h>\n"
+	     "#include <stdlib.h>\n\n"
+	     "#include <kcgi.h>\n\n"
+	     "#include \"extern.h\"");
+
+	for (n = 1; n < argc; n++) {
+		buf = readall(argv[n], &sz);
+
+		/* Literal text first: everything but the keys. */
+
+		printf("\nstatic const char text%d[] =\n", n);
+		for (i = j = 0; i < sz; ) {
+			if ((kl = keylen(&buf[i])) > 0) {
+				putlit(&buf[j], i - j);
+				i = j = i + kl + 4;
+			} else
+				i++;
+		}
+		putlit(&buf[j], sz - j);
+		if (sz == 0)
+			puts("\t\"\"");
+		puts("\t;");
+
+		/* Then the segments: each text run and its key. */
+
+		printf("\nstatic const struct tmplseg segs%d[] = {\n", n);
+		for (i = j = off = 0; i <= sz; ) {
+			kl = i < sz ? keylen(&buf[i]) : 0;
+			if (kl == 0 && i < sz) {
+				i++;
+				continue;
+			}
+			len = i - j;
+			if (kl > 0)
+				printf("\t{ %zu, %zu, \"%.*s\" },\n",
+					off, len, (int)kl, &buf[i + 2]);
+			else
+				printf("\t{ %zu, %zu, NULL },\n", off, len);
+			off += len;
+			segs[n]++;
+			if (kl == 0)
+				break;
+			i = j = i + kl + 4;
+		}
+		puts("};");
+		free(buf);
+	}
+
+	/* Templates are named as in DATADIR. */
+
+	puts("\nconst struct tmplbin tmplbins[] = {");
+	for (n = 1; n < argc; n++) {
+		if ((cp = strrchr(argv[n], '/')) != NULL)
+			cp++;
+		else
+			cp = argv[n];
+		printf("\t{ \"%s\", text%d, segs%d, %zu },\n",
+			cp, n, n, segs[n]);
+	}
+	puts("\t{ NULL, NULL, NULL, 0 }\n};");
+	free(segs);
+	return 0;
+}
@@ -0,0 +1,639 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * A filename index in SEARCHDIR of every path under FILEDIR, for
+ * case-insensitive substring search.
+ *
+ * The index is the NUL-terminated paths (directories with a trailing
+ * slash) packed into fixed-size blocks, followed by a bitmap for each
+ * block of the trigrams found in it.
+ * A query only reads the blocks whose bitmap has all of its trigrams,
+ * so most of the index is never touched.
+ * It's mapped, not read, and is rebuilt in the background by walking
+ * the tree when older than SEARCH_MAXAGE.
+ *
+ * Between rebuilds, our own mutation paths append each added or removed
+ * path to a journal, whose last word on a path overrides the index.
+ * A rebuild first sets the journal aside, as the walk will see all of
+ * those changes, and removes it when done.
+ * A long journal also has the index rebuilt, and a full one, which
+ * drops changes, has searches reported as incomplete until then.
+ */
+
+#define	SEARCH_MAGIC	 "httpdsx1"
+#define	SEARCH_BLOCK	 1024 /* bytes of paths per block */
+#define	SEARCH_BITS	 4096 /* bits of trigrams per block */
+#define	SEARCH_MAXAGE	 (24 * 60 * 60) /* seconds between rebuilds */
+#define	SEARCH_MAXDEPTH	 64 /* deepest directory walked */
+#define	SEARCH_JOURNALSZ (256 * 1024) /* rebuild beyond this */
+#define	SEARCH_JOURNALMAX (4 * SEARCH_JOURNALSZ) /* never beyond this */
+#define	SEARCH_INDEX	 "index"
+#define	SEARCH_JOURNAL	 "journal"
+#define	SEARCH_OLD	 "journal.old" /* journal during a rebuild */
+#define	SEARCH_LOCK	 ".rebuild" /* held while rebuilding */
+
+/*
+ * Start of the index.
+ * It's followed by "blocks" blocks of paths, then their bitmaps.
+ */
+struct	sxhead {
+	char		 magic[8];
+	uint64_t	 blocks;
+	int64_t		 stamp; /* when walked */
+};
+
+/*
+ * An index being written.
+ */
+struct	sxbuild {
+	const struct sys *sys;
+	int		 fd;
+	int		 error; /* write failed */
+	char		 blk[SEARCH_BLOCK]; /* current block */
+	size_t		 blksz; /* bytes in block */
+	uint8_t		*bits; /* bitmaps of all blocks */
+	size_t		 blocks; /* blocks written */
+	size_t		 bitsmax; /* bitmaps allocated */
+	uint64_t	 paths; /* paths written */
+	char		 path[PATH_MAX + 1]; /* current path */
+};
+
+/*
+ * The last journal entry for a path.
+ */
+struct	sxjent {
+	const char	*path;
+	size_t		 seq; /* order in journal */
+	int		 add; /* added (or removed)? */
+};
+
+/*
+ * The journal, all entries sorted by path.
+ */
+struct	sxjournal {
+	char		*buf;
+	struct sxjent	*ents;
+	size_t		 entsz;
+	int		 full; /* changes may have been dropped */
+};
+
+/*
+ * Open (creating if needed) our index directory.
+ * Returns the descriptor or -1 on failure.
+ */
+static int
+search_dir(const struct sys *sys)
+{
+	int	 fd;
+
+	fd = open(SEARCHDIR, O_RDONLY|O_DIRECTORY, 0);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir(SEARCHDIR, 0700) == -1 && errno != EEXIST) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s: mkdir", SEARCHDIR);
+			return -1;
+		}
+		fd = open(SEARCHDIR, O_RDONLY|O_DIRECTORY, 0);
+	}
+	if (fd == -1)
+		kutil_warn(&sys->req, sys->curuser, "%s", SEARCHDIR);
+	return fd;
+}
+
+/*
+ * The bit of the (case-folded) trigram at "p".
+ */
+static size_t
+search_tri(const char *p)
+{
+	uint32_t	 h;
+
+	h = tolower((unsigned char)p[0]) |
+		tolower((unsigned char)p[1]) << 8 |
+		tolower((unsigned char)p[2]) << 16;
+	return (h * 2654435761U) >> (32 - 12);
+}
+
+static void
+search_bits(uint8_t *bits, const char *p, size_t sz)
+{
+	size_t	 i, b;
+
+	for (i = 0; i + 3 <= sz; i++) {
+		b = search_tri(p + i);
+		bits[b / 8] |= 1 << (b % 8);
+	}
+}
+
+/*
+ * Append a record of "path" being added or removed to the journal,
+ * unless it's already full: then the next search will rebuild the
+ * index (we can't fork here) and, until it's done, report that its
+ * results are incomplete.
+ */
+static void
+search_note(const struct sys *sys, const char *dir,
+	const char *name, int isdir, int add)
+{
+	int		 sfd, fd;
+	struct stat	 st;
+	char		 buf[PATH_MAX + 3];
+	int		 sz;
+
+	if ( ! isdir && name[0] == '.')
+		return;
+	sz = snprintf(buf, sizeof(buf), "%c%s%s%s%s", add ? '+' : '-',
+		dir, dir[0] != '\0' ? "/" : "", name, isdir ? "/" : "");
+	if (sz < 0 || (size_t)sz >= sizeof(buf))
+		return;
+	if ((sfd = search_dir(sys)) == -1)
+		return;
+	fd = openat(sfd, SEARCH_JOURNAL,
+		O_WRONLY|O_APPEND|O_CREAT, 0600);
+	close(sfd);
+	if (fd == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", SEARCHDIR, SEARCH_JOURNAL);
+		return;
+	}
+
+	/* Write with the NUL in one go, so records never interleave. */
+
+	if (fstat(fd, &st) != -1 && st.st_size < SEARCH_JOURNALMAX &&
+	    write(fd, buf, sz + 1) != sz + 1)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: write", SEARCHDIR, SEARCH_JOURNAL);
+	close(fd);
+}
+
+/*
+ * The file or directory "name" has been created in "dir".
+ */
+void
+search_add(const struct sys *sys, const char *dir,
+	const char *name, int isdir)
+{
+
+	search_note(sys, dir, name, isdir, 1);
+}
+
+/*
+ * The file or directory "name" has been removed from "dir".
+ */
+void
+search_remove(const struct sys *sys, const char *dir,
+	const char *name, int isdir)
+{
+
+	search_note(sys, dir, name, isdir, 0);
+}
+
+static int
+search_jent_cmp(const void *p1, const void *p2)
+{
+	const struct sxjent *e1 = p1, *e2 = p2;
+	int	 rc;
+
+	if ((rc = strcmp(e1->path, e2->path)) != 0)
+		return rc;
+	return e1->seq < e2->seq ? -1 : e1->seq > e2->seq;
+}
+
+/*
+ * Read the journals in "sfd", set aside then current, into "j",
+ * keeping only the last entry for each path, and noting whether either
+ * is full (see search_note()).
+ * Returns the total size of the journals.
+ */
+static size_t
+search_journal(int sfd, struct sxjournal *j)
+{
+	const char	*names[2] = { SEARCH_OLD, SEARCH_JOURNAL };
+	size_t		 i, sz = 0, max = 0, k;
+	int		 fd;
+	struct stat	 st;
+	ssize_t		 ssz;
+	char		*cp, *end;
+
+	memset(j, 0, sizeof(struct sxjournal));
+
+	for (i = 0; i < 2; i++) {
+		if ((fd = openat(sfd, names[i], O_RDONLY, 0)) == -1)
+			continue;
+		if (fstat(fd, &st) == -1) {
+			close(fd);
+			continue;
+		}
+		if (st.st_size >= SEARCH_JOURNALMAX)
+			j->full = 1;
+		if (st.st_size == 0 ||
+		    st.st_size > SEARCH_JOURNALMAX + PATH_MAX + 3) {
+			close(fd);
+			continue;
+		}
+		j->buf = krealloc(j->buf, sz + st.st_size + 1);
+		if ((ssz = read(fd, j->buf + sz, st.st_size)) > 0)
+			sz += ssz;
+		close(fd);
+	}
+	if (sz == 0)
+		return 0;
+
+	/* Make sure the last record ends, even if cut short. */
+
+	j->buf[sz] = '\0';
+	for (cp = j->buf, end = j->buf + sz; cp < end;
+	     cp += strlen(cp) + 1) {
+		if (cp[0] != '+' && cp[0] != '-')
+			continue;
+		if (j->entsz == max) {
+			max = max == 0 ? 64 : max * 2;
+			j->ents = kreallocarray(j->ents,
+				max, sizeof(struct sxjent));
+		}
+		j->ents[j->entsz].path = cp + 1;
+		j->ents[j->entsz].add = cp[0] == '+';
+		j->ents[j->entsz].seq = j->entsz;
+		j->entsz++;
+	}
+
+	/* Keep the last of each path. */
+
+	qsort(j->ents, j->entsz, sizeof(struct sxjent), search_jent_cmp);
+	for (i = k = 0; i < j->entsz; i++) {
+		if (i + 1 < j->entsz &&
+		    strcmp(j->ents[i].path, j->ents[i + 1].path) == 0)
+			continue;
+		j->ents[k++] = j->ents[i];
+	}
+	j->entsz = k;
+	return sz;
+}
+
+static int
+search_jent_cmp_path(const void *p1, const void *p2)
+{
+	const struct sxjent *e1 = p1, *e2 = p2;
+
+	return strcmp(e1->path, e2->path);
+}
+
+static const struct sxjent *
+search_journal_find(const struct sxjournal *j, const char *path)
+{
+	struct sxjent	 key;
+
+	if (j->entsz == 0)
+		return NULL;
+	memset(&key, 0, sizeof(struct sxjent));
+	key.path = path;
+	return bsearch(&key, j->ents, j->entsz,
+		sizeof(struct sxjent), search_jent_cmp_path);
+}
+
+/*
+ * Whether "path" is under "scope" (of length "len") and the rest of it
+ * has "q" in it.
+ */
+static int
+search_match(const char *path, const char *scope, size_t len,
+	const char *q)
+{
+
+	if (len > 0 &&
+	    (strncmp(path, scope, len) || path[len] != '/'))
+		return 0;
+	return strcasestr(len > 0 ? path + len + 1 : path, q) != NULL;
+}
+
+/*
+ * Pass to "fn" with "arg" at most "max" paths under the directory
+ * "scope" with the case-insensitive substring "q" in them.
+ * Directories are passed with a trailing slash.
+ * Returns 1 if all paths were searched, 0 if not (the index is still
+ * being built or the journal is full), -1 on failure.
+ * Needs the "proc" promise, as this may start a rebuild.
+ */
+int
+search_find(const struct sys *sys, const char *scope, const char *q,
+	size_t max, search_fn fn, void *arg)
+{
+	int		 sfd, fd, rc = -1, stale = 0;
+	struct stat	 st;
+	struct sxhead	 h;
+	struct sxjournal j;
+	const struct sxjent *je;
+	uint8_t		 want[SEARCH_BITS / 8];
+	const uint8_t	*bits;
+	void		*map = MAP_FAILED;
+	const char	*blks, *cp, *end;
+	size_t		 i, k, sz = 0, found = 0, len = strlen(scope);
+
+	if ((sfd = search_dir(sys)) == -1)
+		return -1;
+	if (search_journal(sfd, &j) > SEARCH_JOURNALSZ)
+		stale = 1;
+
+	memset(want, 0, sizeof(want));
+	search_bits(want, q, strlen(q));
+
+	if ((fd = openat(sfd, SEARCH_INDEX, O_RDONLY, 0)) == -1) {
+		if (errno != ENOENT) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s", SEARCHDIR, SEARCH_INDEX);
+			goto out;
+		}
+		rc = 0;
+		stale = 1;
+		goto journal;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+	    pread(fd, &h, sizeof(struct sxhead), 0) !=
+	    sizeof(struct sxhead) ||
+	    memcmp(h.magic, SEARCH_MAGIC, sizeof(h.magic)) ||
+	    (uint64_t)st.st_size != sizeof(struct sxhead) +
+	    h.blocks * (SEARCH_BLOCK + SEARCH_BITS / 8)) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: bad index", SEARCHDIR, SEARCH_INDEX);
+		close(fd);
+		rc = 0;
+		stale = 1;
+		goto journal;
+	}
+
+	stale = stale || h.stamp < time(NULL) - SEARCH_MAXAGE;
+	sz = st.st_size;
+	if (h.blocks > 0 && (map = mmap(NULL, sz,
+	    PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: mmap", SEARCHDIR, SEARCH_INDEX);
+		close(fd);
+		goto out;
+	}
+	close(fd);
+	rc = 1;
+
+	if (map == MAP_FAILED)
+		goto journal;
+
+	blks = (const char *)map + sizeof(struct sxhead);
+	bits = (const uint8_t *)blks + h.blocks * SEARCH_BLOCK;
+
+	for (i = 0; i < h.blocks && found < max; i++) {
+		for (k = 0; k < sizeof(want); k++)
+			if ((bits[k] & want[k]) != want[k])
+				break;
+		bits += SEARCH_BITS / 8;
+		if (k < sizeof(want))
+			continue;
+		cp = blks + i * SEARCH_BLOCK;
+		end = cp + SEARCH_BLOCK;
+		for ( ; cp < end && *cp != '\0' && found < max;
+		     cp += strlen(cp) + 1) {
+			if ( ! search_match(cp, scope, len, q) ||
+			    search_journal_find(&j, cp) != NULL)
+				continue;
+			(*fn)(cp, arg);
+			found++;
+		}
+	}
+journal:
+	for (i = 0; i < j.entsz && found < max; i++) {
+		je = &j.ents[i];
+		if (je->add && search_match(je->path, scope, len, q)) {
+			(*fn)(je->path, arg);
+			found++;
+		}
+	}
+	if (rc > 0 && j.full)
+		rc = 0;
+	if (stale)
+		search_rebuild(sys);
+out:
+	if (map != MAP_FAILED)
+		munmap(map, sz);
+	free(j.ents);
+	free(j.buf);
+	close(sfd);
+	return rc;
+}
+
+/*
+ * Close off the current block, if any.
+ */
+static void
+search_block(struct sxbuild *b)
+{
+
+	if (b->blksz == 0)
+		return;
+	memset(b->blk + b->blksz, 0, SEARCH_BLOCK - b->blksz);
+	if ( ! b->error &&
+	    write(b->fd, b->blk, SEARCH_BLOCK) != SEARCH_BLOCK) {
+		kutil_warn(&b->sys->req, b->sys->curuser,
+			"%s: write", SEARCHDIR);
+		b->error = 1;
+	}
+	b->blocks++;
+	b->blksz = 0;
+}
+
+/*
+ * Add "b->path" of length "sz" to the index.
+ */
+static void
+search_path(struct sxbuild *b, size_t sz)
+{
+
+	if (sz + 1 > SEARCH_BLOCK)
+		return;
+	if (b->blksz + sz + 1 > SEARCH_BLOCK)
+		search_block(b);
+	if (b->blksz == 0) {
+		if (b->blocks == b->bitsmax) {
+			b->bitsmax = b->bitsmax == 0 ?
+				1024 : b->bitsmax * 2;
+			b->bits = kreallocarray(b->bits,
+				b->bitsmax, SEARCH_BITS / 8);
+		}
+		memset(b->bits + b->blocks * (SEARCH_BITS / 8),
+			0, SEARCH_BITS / 8);
+	}
+	memcpy(b->blk + b->blksz, b->path, sz + 1);
+	b->blksz += sz + 1;
+	search_bits(b->bits + b->blocks * (SEARCH_BITS / 8),
+		b->path, sz);
+	b->paths++;
+}
+
+/*
+ * Add everything under the directory "dfd" (closed on return), whose
+ * path of length "len" is in "b->path", to the index.
+ */
+static void
+search_walk(struct sxbuild *b, int dfd, size_t len, size_t depth)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	int		 fd, sz;
+
+	if ((dir = fdopendir(dfd)) == NULL) {
+		kutil_warn(&b->sys->req, b->sys->curuser,
+			"%s: fdopendir", b->path);
+		close(dfd);
+		return;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(dir), dp->d_name,
+		    &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		if ( ! S_ISDIR(st.st_mode) &&
+		    ! (S_ISREG(st.st_mode) && dp->d_name[0] != '.'))
+			continue;
+
+		sz = snprintf(b->path + len, sizeof(b->path) - len,
+			"%s%s%s", len > 0 ? "/" : "", dp->d_name,
+			S_ISDIR(st.st_mode) ? "/" : "");
+		if (sz < 0 || (size_t)sz >= sizeof(b->path) - len) {
+			b->path[len] = '\0';
+			continue;
+		}
+		search_path(b, len + sz);
+
+		/* Descend without the trailing slash. */
+
+		if (S_ISDIR(st.st_mode) && depth < SEARCH_MAXDEPTH) {
+			b->path[len + sz - 1] = '\0';
+			fd = openat(dirfd(dir), dp->d_name,
+				O_RDONLY|O_DIRECTORY|O_NOFOLLOW, 0);
+			if (fd != -1)
+				search_walk(b, fd, len + sz - 1, depth + 1);
+		}
+		b->path[len] = '\0';
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Rebuild the index in the background (see detach()).
+ * Only one rebuild runs at a time: others are simply dropped.
+ */
+void
+search_rebuild(const struct sys *sys)
+{
+	int		 sfd, lfd, dfd;
+	struct sxbuild	*b;
+	struct sxhead	 h;
+	char		 tmp[32];
+	size_t		 bitsz;
+
+	if (detach(sys))
+		return;
+
+	if ((sfd = search_dir(sys)) == -1)
+		_exit(EXIT_FAILURE);
+	lfd = openat(sfd, SEARCH_LOCK, O_RDWR|O_CREAT, 0600);
+	if (lfd == -1 || flock(lfd, LOCK_EX|LOCK_NB) == -1)
+		_exit(EXIT_SUCCESS);
+
+	/*
+	 * Set aside the journal (over any left by a failed rebuild), as
+	 * everything in it will be seen by the walk.
+	 * Searches use both journals until we're done.
+	 */
+
+	if (renameat(sfd, SEARCH_JOURNAL, sfd, SEARCH_OLD) == -1 &&
+	    errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: renameat", SEARCHDIR, SEARCH_JOURNAL);
+
+	b = kcalloc(1, sizeof(struct sxbuild));
+	b->sys = sys;
+	snprintf(tmp, sizeof(tmp), ".%s.%08" PRIx32,
+		SEARCH_INDEX, arc4random());
+	if ((b->fd = openat(sfd, tmp,
+	    O_WRONLY|O_CREAT|O_EXCL, 0600)) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", SEARCHDIR, tmp);
+		_exit(EXIT_FAILURE);
+	}
+
+	/* The header is filled in when we're done. */
+
+	memset(&h, 0, sizeof(struct sxhead));
+	if (write(b->fd, &h, sizeof(struct sxhead)) !=
+	    sizeof(struct sxhead))
+		b->error = 1;
+
+	if ((dfd = dup(sys->filefd)) != -1)
+		search_walk(b, dfd, 0, 0);
+	else
+		b->error = 1;
+	search_block(b);
+
+	bitsz = b->blocks * (SEARCH_BITS / 8);
+	memcpy(h.magic, SEARCH_MAGIC, sizeof(h.magic));
+	h.blocks = b->blocks;
+	h.stamp = time(NULL);
+	if (b->error ||
+	    (bitsz > 0 && write(b->fd, b->bits, bitsz) != (ssize_t)bitsz) ||
+	    pwrite(b->fd, &h, sizeof(struct sxhead), 0) !=
+	    sizeof(struct sxhead) ||
+	    close(b->fd) == -1 ||
+	    renameat(sfd, tmp, sfd, SEARCH_INDEX) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: index not written", SEARCHDIR, tmp);
+		unlinkat(sfd, tmp, 0);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (unlinkat(sfd, SEARCH_OLD, 0) == -1 && errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: unlinkat", SEARCHDIR, SEARCH_OLD);
+	kutil_info(&sys->req, sys->curuser, "search index rebuilt: "
+		"%" PRIu64 " paths, %zu blocks", b->paths, b->blocks);
+	_exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,388 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * A POSIX ustar archive of a directory subtree, written as a stream.
+ * The tree is walked depth-first with one open directory per level, so
+ * memory use is bounded by the tree's depth, not its size.
+ * Names or sizes that don't fit in the ustar header are carried by a
+ * preceding pax extended header.
+ * Ownership isn't exported: all entries are owned by uid and gid zero.
+ */
+
+#define	TAR_BLOCK	 512
+#define	TAR_MAXDEPTH	 64 /* deepest directory walked */
+#define	TAR_MAXSIZE	 077777777777LL /* largest ustar size */
+
+/*
+ * The output stream.
+ */
+struct	tout {
+	const struct sys *sys;
+	uint64_t	 off; /* bytes written so far */
+	int		 live; /* client still there? */
+	char		 path[PATH_MAX]; /* current path */
+};
+
+/*
+ * Write to the client, tracking our offset.
+ * Returns zero if the client has gone away.
+ */
+static int
+twrite(struct tout *t, const void *buf, size_t sz)
+{
+
+	if (t->live && sz > 0 &&
+	    khttp_write((struct kreq *)&t->sys->req,
+	     buf, sz) != KCGI_OK)
+		t->live = 0;
+	t->off += sz;
+	return t->live;
+}
+
+/*
+ * Pad the output to the next block boundary.
+ */
+static int
+tpad(struct tout *t)
+{
+	static const char zero[TAR_BLOCK];
+
+	return twrite(t, zero,
+		(TAR_BLOCK - t->off % TAR_BLOCK) % TAR_BLOCK);
+}
+
+/*
+ * Write "v" as a NUL-terminated octal number into the field "p" of
+ * length "sz".
+ */
+static void
+tar_octal(char *p, size_t sz, uint64_t v)
+{
+
+	snprintf(p, sz, "%0*" PRIo64, (int)sz - 1, v);
+}
+
+/*
+ * Format a pax record of "key" and "val".
+ * Each record is prefixed by its own length in decimal, which includes
+ * the digits of the length itself.
+ */
+static char *
+tar_pax_rec(const char *key, const char *val)
+{
+	size_t	 len, sz, dig;
+	char	*p;
+
+	len = strlen(key) + strlen(val) + 3;
+	for (dig = 1; ; dig++) {
+		sz = len + dig;
+		if ((size_t)snprintf(NULL, 0, "%zu", sz) == dig)
+			break;
+	}
+	kasprintf(&p, "%zu %s=%s\n", sz, key, val);
+	return p;
+}
+
+/*
+ * Emit a pax extended header for the entry about to be written, with a
+ * "path" record if "path" is non-NULL and a "size" record if "size" is
+ * not negative.
+ */
+static int
+tar_pax(struct tout *t, const char *path, int64_t size)
+{
+	char		 hdr[TAR_BLOCK], num[32];
+	char		*buf, *rec;
+	size_t		 len, i;
+	unsigned int	 sum = 0;
+	int		 rc;
+
+	buf = kstrdup("");
+	if (path != NULL) {
+		rec = tar_pax_rec("path", path);
+		free(buf);
+		buf = rec;
+	}
+	if (size >= 0) {
+		snprintf(num, sizeof(num), "%" PRId64, size);
+		rec = tar_pax_rec("size", num);
+		path = buf;
+		kasprintf(&buf, "%s%s", path, rec);
+		free((char *)path);
+		free(rec);
+	}
+	len = strlen(buf);
+
+	memset(hdr, 0, sizeof(hdr));
+	strlcpy(hdr, "././@PaxHeader", 100);
+	tar_octal(hdr + 100, 8, 0644);
+	tar_octal(hdr + 108, 8, 0);
+	tar_octal(hdr + 116, 8, 0);
+	tar_octal(hdr + 124, 12, len);
+	tar_octal(hdr + 136, 12, 0);
+	hdr[156] = 'x';
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < sizeof(hdr); i++)
+		sum += (unsigned char)hdr[i];
+	snprintf(hdr + 148, 8, "%06o", sum);
+
+	rc = twrite(t, hdr, sizeof(hdr)) &&
+		twrite(t, buf, len) && tpad(t);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Emit the header for the entry at t->path, which for directories must
+ * end in a slash.
+ */
+static int
+tar_header(struct tout *t, const struct stat *st)
+{
+	char		 hdr[TAR_BLOCK];
+	const char	*path = t->path, *cp;
+	size_t		 len = strlen(path), i;
+	unsigned int	 sum = 0;
+	int		 isdir = S_ISDIR(st->st_mode), bigpath = 0;
+	int64_t		 size = isdir ? 0 : st->st_size;
+
+	memset(hdr, 0, sizeof(hdr));
+
+	/*
+	 * Split a long path into prefix and name at a slash, if one fits
+	 * into both fields; otherwise, fall back on a pax header.
+	 */
+
+	if (len <= 100)
+		memcpy(hdr, path, len);
+	else {
+		for (cp = path + len - 1; cp > path; cp--)
+			if (*(cp - 1) == '/' &&
+			    (size_t)(path + len - cp) <= 100 &&
+			    (size_t)(cp - path - 1) <= 155)
+				break;
+		if (cp > path && (isdir ? cp < path + len - 1 : 1)) {
+			memcpy(hdr, cp, path + len - cp);
+			memcpy(hdr + 345, path, cp - path - 1);
+		} else {
+			memcpy(hdr, path, 100);
+			bigpath = 1;
+		}
+	}
+
+	if ((bigpath || size > TAR_MAXSIZE) &&
+	    ! tar_pax(t, bigpath ? path : NULL,
+	      size > TAR_MAXSIZE ? size : -1))
+		return 0;
+
+	tar_octal(hdr + 100, 8, st->st_mode & 0777);
+	tar_octal(hdr + 108, 8, 0);
+	tar_octal(hdr + 116, 8, 0);
+	tar_octal(hdr + 124, 12, size > TAR_MAXSIZE ? 0 : size);
+	tar_octal(hdr + 136, 12, st->st_mtime < 0 ? 0 : st->st_mtime);
+	hdr[156] = isdir ? '5' : '0';
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < sizeof(hdr); i++)
+		sum += (unsigned char)hdr[i];
+	snprintf(hdr + 148, 8, "%06o", sum);
+
+	return twrite(t, hdr, sizeof(hdr));
+}
+
+/*
+ * Emit the regular file "fd" as described by "st".
+ * Exactly st->st_size bytes are written, padding with zeroes if the
+ * file has shrunk, since the header has already promised that many.
+ */
+static int
+tar_file(struct tout *t, int fd, const struct stat *st)
+{
+	static char	 buf[256 * 1024];
+	uint64_t	 left = st->st_size;
+	size_t		 sz;
+	ssize_t		 ssz;
+
+	if ( ! tar_header(t, st))
+		return 0;
+
+	while (left > 0) {
+		sz = left > sizeof(buf) ? sizeof(buf) : left;
+		if ((ssz = read(fd, buf, sz)) == -1) {
+			kutil_warn(&t->sys->req, t->sys->curuser,
+				"%s: read", t->path);
+			ssz = 0;
+		}
+		if (ssz == 0) {
+			memset(buf, 0, sz);
+			ssz = sz;
+		}
+		if ( ! twrite(t, buf, ssz))
+			return 0;
+		left -= ssz;
+	}
+	return tpad(t);
+}
+
+/*
+ * Walk the directory "dfd", whose path (ending in a slash) is in
+ * t->path, emitting everything beneath it.
+ * This closes "dfd".
+ * Returns zero if the client has gone away.
+ */
+static int
+tar_walk(struct tout *t, int dfd, size_t depth)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	size_t		 len = strlen(t->path), sz;
+	int		 fd, rc = 1;
+
+	if ((dir = fdopendir(dfd)) == NULL) {
+		kutil_warn(&t->sys->req, t->sys->curuser,
+			"%s: fdopendir", t->path);
+		close(dfd);
+		return 1;
+	}
+
+	while (rc && (dp = readdir(dir)) != NULL) {
+		/* The same filter as directory listings. */
+
+		if ((dp->d_type != DT_DIR && dp->d_type != DT_REG) ||
+		    strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0 ||
+		    (dp->d_type == DT_REG && dp->d_name[0] == '.'))
+			continue;
+
+		sz = strlcpy(t->path + len, dp->d_name,
+			sizeof(t->path) - len);
+		if (len + sz + 1 >= sizeof(t->path)) {
+			t->path[len] = '\0';
+			kutil_warnx(&t->sys->req, t->sys->curuser,
+				"%s%s: path too long", t->path,
+				dp->d_name);
+			continue;
+		}
+
+		if (dp->d_type == DT_REG) {
+			fd = openat(dirfd(dir), dp->d_name,
+				O_RDONLY | O_NOFOLLOW, 0);
+			if (fd == -1) {
+				kutil_warn(&t->sys->req,
+					t->sys->curuser,
+					"%s: openat", t->path);
+				continue;
+			}
+			if (fstat(fd, &st) != -1 && S_ISREG(st.st_mode))
+				rc = tar_file(t, fd, &st);
+			close(fd);
+			continue;
+		}
+
+		if (depth >= TAR_MAXDEPTH) {
+			kutil_warnx(&t->sys->req, t->sys->curuser,
+				"%s: too deep", t->path);
+			continue;
+		}
+		fd = openat(dirfd(dir), dp->d_name,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+		if (fd == -1) {
+			kutil_warn(&t->sys->req, t->sys->curuser,
+				"%s: openat", t->path);
+			continue;
+		} else if (fstat(fd, &st) == -1) {
+			close(fd);
+			continue;
+		}
+		t->path[len + sz] = '/';
+		t->path[len + sz + 1] = '\0';
+		if ((rc = tar_header(t, &st)))
+			rc = tar_walk(t, fd, depth + 1);
+		else
+			close(fd);
+	}
+
+	t->path[len] = '\0';
+	closedir(dir);
+	return rc;
+}
+
+/*
+ * Stream a tar archive of the subtree at directory "nfd", its entries
+ * prefixed by "root", to the client, whose headers must already have
+ * been sent.
+ * Returns zero if the archive could not be completed.
+ */
+int
+tar_stream(const struct sys *sys, int nfd, const char *root)
+{
+	struct tout	*t;
+	struct stat	 st;
+	int		 fd, rc;
+	char		 end[TAR_BLOCK * 2];
+
+	t = kcalloc(1, sizeof(struct tout));
+	t->sys = sys;
+	t->live = 1;
+
+	if (fstat(nfd, &st) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s: fstat", sys->resource);
+		free(t);
+		return 0;
+	} else if ((fd = dup(nfd)) == -1) {
+		kutil_warn(&sys->req, sys->curuser, "dup");
+		free(t);
+		return 0;
+	}
+
+	snprintf(t->path, sizeof(t->path), "%s/", root);
+	if ( ! tar_header(t, &st))
+		close(fd);
+	else if (tar_walk(t, fd, 0)) {
+		memset(end, 0, sizeof(end));
+		twrite(t, end, sizeof(end));
+	}
+
+	rc = t->live;
+	kutil_info(&sys->req, sys->curuser,
+		"%s: tar of %" PRIu64 " bytes%s",
+		sys->resource, t->off, rc ? "" : " (incomplete)");
+	free(t);
+	return rc;
+}
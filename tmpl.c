@@ -0,0 +1,109 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Get the template "name" ready for tmpl_write().
+ * Templates compiled in are used as-is.
+ * Otherwise (or if compiled with RUNTIME_TEMPLATES, as when working on
+ * them) it's opened from DATADIR, which must be done before sandboxing.
+ * Returns zero if there's no template, which has been logged.
+ */
+int
+tmpl_open(const struct sys *sys, const char *name, struct tmpl *tp)
+{
+#ifndef RUNTIME_TEMPLATES
+	const struct tmplbin *bin;
+#endif
+
+	memset(tp, 0, sizeof(struct tmpl));
+	tp->fd = -1;
+
+#ifndef RUNTIME_TEMPLATES
+	for (bin = tmplbins; bin->name != NULL; bin++)
+		if (strcmp(bin->name, name) == 0) {
+			tp->bin = bin;
+			return 1;
+		}
+#endif
+
+	kasprintf(&tp->fn, "%s/%s", DATADIR, name);
+	if ((tp->fd = open(tp->fn, O_RDONLY, 0)) == -1) {
+		kutil_warn(&sys->req, sys->curuser, "%s", tp->fn);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Fill in and send the template "tp" with "t".
+ * For those compiled in, this just writes each run of text and calls
+ * back for its key, as khttp_template_fd() would: keys not in "t" are
+ * sent as they are, and sending stops if the callback fails.
+ * Returns zero if there's no template or it couldn't be sent.
+ */
+int
+tmpl_write(struct sys *sys, const struct tmpl *tp,
+	const struct ktemplate *t)
+{
+	struct kreq		*r = &sys->req;
+	const struct tmplseg	*seg;
+	size_t			 i, j;
+
+	if (tp->bin == NULL)
+		return tp->fd != -1 &&
+			khttp_template_fd(r, t, tp->fd, tp->fn) == KCGI_OK;
+
+	for (i = 0; i < tp->bin->segsz; i++) {
+		seg = &tp->bin->segs[i];
+		if (khttp_write(r, tp->bin->text + seg->off,
+		    seg->sz) != KCGI_OK)
+			return 0;
+		if (seg->key == NULL)
+			continue;
+		for (j = 0; j < t->keysz; j++)
+			if (strcmp(t->key[j], seg->key) == 0)
+				break;
+		if (j == t->keysz) {
+			if (khttp_puts(r, "@@") != KCGI_OK ||
+			    khttp_puts(r, seg->key) != KCGI_OK ||
+			    khttp_puts(r, "@@") != KCGI_OK)
+				return 0;
+		} else if ( ! t->cb(j, t->arg))
+			return 0;
+	}
+	return 1;
+}
+
+void
+tmpl_close(struct tmpl *tp)
+{
+
+	if (tp->fd != -1)
+		close(tp->fd);
+	free(tp->fn);
+}
@@ -0,0 +1,1067 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+
+#include "extern.h"
+
+/*
+ * Size of the window over the request body.
+ * This bounds the memory used for an upload of any size.
+ */
+#define	UPLOAD_BUFSZ (64 * 1024)
+
+/*
+ * Reading state of a multipart/form-data body.
+ */
+struct	upload {
+	char		 buf[UPLOAD_BUFSZ]; /* window over body */
+	size_t		 bufsz; /* bytes in window */
+	int64_t		 left; /* body bytes not yet read */
+	char		 delim[80]; /* CRLF, "--", boundary */
+	size_t		 delimsz; /* length of delim */
+};
+
+/*
+ * Open a new staging file in the directory "dfd" for writing the file
+ * "name", filling its (hidden) name into "buf" of size "sz".
+ * Staging files are dot-files, so they never appear in listings, and
+ * the directory's cached listing is kept valid across creating one.
+ * Returns the open descriptor or -1 on failure.
+ */
+int
+stage_open(const struct sys *sys, int dfd,
+	const char *name, char *buf, size_t sz)
+{
+	int		 fd;
+	struct dirtx	*tx;
+
+	tx = dircache_begin(sys, dfd, ".");
+	do {
+		snprintf(buf, sz, ".httpdrop.%08" PRIx32 "%08" PRIx32,
+			arc4random(), arc4random());
+		fd = openat(dfd, buf, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	} while (fd == -1 && errno == EEXIST);
+	dircache_commit(tx, NULL);
+
+	if (fd == -1)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: openat (staging)", sys->resource, name);
+	return fd;
+}
+
+/*
+ * If "name" in "dfd", the directory "path", which is "st", is a staging
+ * file left behind (e.g., by a killed upload) for UPLOAD_MAXAGE, remove
+ * it.
+ * The change time is used as the link made by dedup_link() has its
+ * blob's modification time.
+ */
+void
+stage_reap(const struct sys *sys, int dfd, const char *path,
+	const char *name, const struct stat *st)
+{
+	struct dirtx	*tx;
+
+	if (strncmp(name, ".httpdrop.", 10) != 0 ||
+	    ! S_ISREG(st->st_mode) ||
+	    st->st_ctime >= time(NULL) - UPLOAD_MAXAGE)
+		return;
+
+	tx = dircache_begin(sys, dfd, ".");
+	if (unlinkat(dfd, name, 0) == -1 && errno != ENOENT)
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: unlinkat", path, name);
+	else
+		kutil_info(&sys->req, sys->curuser,
+			"%s/%s: staging file abandoned", path, name);
+	dircache_commit(tx, NULL);
+}
+
+/*
+ * Begin publishing the file "name" into "dfd", the directory of the
+ * request, filling in "stg".
+ * This holds the directory locked (see dircache_begin()) until
+ * stage_done(), so only call it just before publishing.
+ */
+void
+stage_begin(const struct sys *sys, int dfd, const char *name,
+	struct stage *stg)
+{
+
+	stg->tx = dircache_begin(sys, dfd, ".");
+	stg->prev = dirsum_fsize(dfd, name);
+	stg->fd = stg->prev == -1 ? -1 :
+		openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_NONBLOCK, 0);
+}
+
+/*
+ * Finish publishing the file "name" into "dfd" begun with
+ * stage_begin(), which was successful if "ok".
+ * If so, account for it having replaced whatever was there before,
+ * including releasing its stored blob and, if it's gone, its
+ * compressed sidecar.
+ */
+void
+stage_done(const struct sys *sys, int dfd, const char *name,
+	struct stage *stg, int ok)
+{
+	struct stat	 st;
+
+	if ( ! ok) {
+		dircache_commit(stg->tx, NULL);
+		if (stg->fd != -1)
+			close(stg->fd);
+		return;
+	}
+	dircache_commit(stg->tx, name);
+	dirsum_file(sys, dfd, name, stg->prev);
+	if (stg->prev == -1)
+		search_add(sys, sys->resource, name, 0);
+	if (stg->fd == -1)
+		return;
+#ifdef DEDUP
+	dedup_replaced(sys, stg->fd, name);
+#endif
+	if (fstat(stg->fd, &st) != -1 && st.st_nlink == 0)
+		gzip_remove(sys, &st);
+	close(stg->fd);
+}
+
+/*
+ * Close the staging file "fd" named "tmp" in "dfd".
+ * If "ok", atomically publish it as "name", replacing whatever was
+ * there; otherwise, remove it.
+ * Readers see either the old file or the complete new one, and
+ * concurrent uploads of the same name never interleave: the last to
+ * finish wins.
+ * If "hex" is not NULL, it's the content hash used to publish by way
+ * of dedup_publish().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+stage_close(const struct sys *sys, int dfd, int fd,
+	const char *tmp, const char *name, int ok, const char *hex)
+{
+	struct stage	 stg;
+	struct dirtx	*tx;
+
+	if (close(fd) == -1 && ok) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: close", sys->resource, name);
+		ok = 0;
+	}
+	if (ok)
+		stage_begin(sys, dfd, name, &stg);
+	if (ok && hex != NULL) {
+		ok = dedup_publish(sys, dfd, tmp, dfd, name, hex);
+		stage_done(sys, dfd, name, &stg, ok);
+		return ok;
+	}
+	if (ok && renameat(dfd, tmp, dfd, name) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: renameat", sys->resource, name);
+		stage_done(sys, dfd, name, &stg, 0);
+		ok = 0;
+	} else if (ok)
+		stage_done(sys, dfd, name, &stg, 1);
+	if ( ! ok) {
+		tx = dircache_begin(sys, dfd, ".");
+		if (unlinkat(dfd, tmp, 0) == -1)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: unlinkat", sys->resource, tmp);
+		dircache_commit(tx, NULL);
+	}
+	return ok;
+}
+
+/*
+ * Decide whether this request is a file upload we should stream
+ * ourselves: a multipart POST with "op=mkfile" in the query string.
+ * If so, hide the body from khttp_parse() by zeroing CONTENT_LENGTH
+ * and return the original length.
+ * Returns -1 if the request is to be handled by kcgi as usual.
+ * This must be called before khttp_parse().
+ */
+int64_t
+upload_stream_init(void)
+{
+	const char	*cp;
+	char		*qs, *tok, *next;
+	long long	 len;
+	int		 found = 0;
+
+	if ((cp = getenv("REQUEST_METHOD")) == NULL ||
+	    strcmp(cp, "POST") != 0)
+		return -1;
+	if ((cp = getenv("CONTENT_TYPE")) == NULL ||
+	    strncasecmp(cp, "multipart/form-data", 19) != 0)
+		return -1;
+	if ((cp = getenv("CONTENT_LENGTH")) == NULL)
+		return -1;
+
+	errno = 0;
+	len = strtoll(cp, &qs, 10);
+	if (errno != 0 || *cp == '\0' || *qs != '\0' || len < 0)
+		return -1;
+
+	if ((cp = getenv("QUERY_STRING")) == NULL)
+		return -1;
+	if ((qs = strdup(cp)) == NULL)
+		return -1;
+	for (next = qs; (tok = strsep(&next, "&")) != NULL; )
+		if (strcmp(tok, "op=mkfile") == 0) {
+			found = 1;
+			break;
+		}
+	free(qs);
+
+	if ( ! found || setenv("CONTENT_LENGTH", "0", 1) == -1)
+		return -1;
+	return len;
+}
+
+/*
+ * Top up the window from standard input.
+ * Returns zero on read failure or if the body ended early, non-zero
+ * otherwise (even if nothing more was available).
+ */
+static int
+upload_fill(const struct sys *sys, struct upload *up)
+{
+	ssize_t	 ssz;
+	size_t	 sz;
+
+	while (up->left > 0 && up->bufsz < sizeof(up->buf)) {
+		sz = sizeof(up->buf) - up->bufsz;
+		if ((int64_t)sz > up->left)
+			sz = up->left;
+		ssz = read(STDIN_FILENO, up->buf + up->bufsz, sz);
+		if (ssz == -1 && errno == EINTR)
+			continue;
+		if (ssz == -1) {
+			kutil_warn(&sys->req, sys->curuser, "read");
+			return 0;
+		} else if (ssz == 0) {
+			kutil_warnx(&sys->req, sys->curuser,
+				"upload: body truncated");
+			return 0;
+		}
+		up->bufsz += ssz;
+		up->left -= ssz;
+	}
+	return 1;
+}
+
+/*
+ * Drop "sz" bytes from the front of the window.
+ */
+static void
+upload_consume(struct upload *up, size_t sz)
+{
+
+	memmove(up->buf, up->buf + sz, up->bufsz - sz);
+	up->bufsz -= sz;
+}
+
+/*
+ * Pass over a part's content up to and including the next delimiter,
+ * writing it into "fd" if not -1 and hashing it into "ctx" if not
+ * NULL.
+ * Returns the number of bytes of content or -1 on failure.
+ */
+static int64_t
+upload_part(const struct sys *sys, struct upload *up,
+	int fd, SHA2_CTX *ctx)
+{
+	char		*cp;
+	size_t		 sz, off;
+	ssize_t		 ssz;
+	int64_t		 total = 0;
+	int		 last;
+
+	for (;;) {
+		if ( ! upload_fill(sys, up))
+			return -1;
+		cp = memmem(up->buf, up->bufsz, up->delim, up->delimsz);
+		last = cp != NULL;
+
+		/*
+		 * Without a delimiter, keep back enough to hold the
+		 * start of one straddling the window's end.
+		 */
+
+		if (last)
+			sz = cp - up->buf;
+		else if (up->bufsz >= up->delimsz)
+			sz = up->bufsz - up->delimsz + 1;
+		else
+			sz = 0;
+
+		if ( ! last && sz == 0) {
+			kutil_warnx(&sys->req, sys->curuser,
+				"upload: missing delimiter");
+			return -1;
+		}
+
+		for (off = 0; fd != -1 && off < sz; off += ssz)
+			if ((ssz = write(fd, up->buf + off,
+			    sz - off)) == -1) {
+				kutil_warn(&sys->req,
+					sys->curuser, "write");
+				return -1;
+			}
+
+		if (ctx != NULL)
+			SHA256Update(ctx, (uint8_t *)up->buf, sz);
+		total += sz;
+		upload_consume(up, last ? sz + up->delimsz : sz);
+		if (last)
+			return total;
+	}
+}
+
+/*
+ * Parse the parameters of a Content-Disposition header value, "val",
+ * which has been nil-terminated.
+ * Values may be tokens or quoted strings, which may contain semicolons
+ * and backslash-escaped characters.
+ * Fills in the field "name" and "file" name (or NULL) pointing into
+ * "val", which is unquoted in place.
+ */
+static void
+upload_disposition(char *val, char **name, char **file)
+{
+	char	*cp = val, *key, *out, *end, **dst;
+	size_t	 keysz;
+
+	*name = *file = NULL;
+	while (*cp != '\0') {
+		while (isspace((unsigned char)*cp) || *cp == ';')
+			cp++;
+		for (key = cp; *cp != '\0' && *cp != '=' && *cp != ';'; cp++)
+			continue;
+		for (keysz = cp - key;
+		     keysz > 0 && isspace((unsigned char)key[keysz - 1]);
+		     keysz--)
+			continue;
+		if (*cp != '=')
+			continue;
+
+		dst = NULL;
+		if (keysz == 4 && strncasecmp(key, "name", 4) == 0)
+			dst = name;
+		else if (keysz == 8 && strncasecmp(key, "filename", 8) == 0)
+			dst = file;
+
+		for (cp++; isspace((unsigned char)*cp); cp++)
+			continue;
+		out = cp;
+		if (dst != NULL)
+			*dst = out;
+
+		if (*cp == '"') {
+			/* Unquote in place: the value only ever shrinks. */
+
+			for (cp++; *cp != '\0' && *cp != '"'; cp++) {
+				if (*cp == '\\' && cp[1] != '\0')
+					cp++;
+				*out++ = *cp;
+			}
+			end = out;
+		} else {
+			while (*cp != '\0' && *cp != ';')
+				cp++;
+			for (end = cp; end > out &&
+			     isspace((unsigned char)end[-1]); end--)
+				continue;
+		}
+		while (*cp != '\0' && *cp != ';')
+			cp++;
+		if (*cp == ';')
+			cp++;
+		*end = '\0';
+	}
+}
+
+/*
+ * A streamed file being published by upload_publish() while the next
+ * is read from the request body.
+ */
+struct	uppub {
+	const struct sys *sys;
+	int		  dfd; /* target directory */
+	int		  fd; /* staging file */
+	char		  tmp[32]; /* staging file name */
+	char		 *file; /* name to publish as */
+	char		  hex[SHA256_DIGEST_STRING_LENGTH];
+	int		  hashed; /* hex is set */
+	int64_t		  size; /* bytes written */
+	int		  ok; /* published? */
+	int		  busy; /* thread running? */
+	pthread_t	  thr;
+};
+
+/*
+ * Publish a fully-written staging file: close, rename into place, and
+ * the bookkeeping (dedup, totals, search, listing cache) that follows.
+ */
+static void *
+upload_publish(void *arg)
+{
+	struct uppub	*p = arg;
+
+	p->ok = stage_close(p->sys, p->dfd, p->fd, p->tmp,
+		p->file, 1, p->hashed ? p->hex : NULL);
+	if (p->ok)
+		kutil_info(&p->sys->req, p->sys->curuser,
+			"%s/%s: wrote %" PRId64 " bytes",
+			p->sys->resource, p->file, p->size);
+	else
+		kutil_warnx(&p->sys->req, p->sys->curuser,
+			"%s/%s: upload failed",
+			p->sys->resource, p->file);
+	return NULL;
+}
+
+/*
+ * Wait for the publication in "p", if any, to finish.
+ * Returns zero if it failed, non-zero otherwise.
+ */
+static int
+upload_publish_wait(struct uppub *p)
+{
+
+	if (p->busy) {
+		pthread_join(p->thr, NULL);
+		p->busy = 0;
+	}
+	free(p->file);
+	p->file = NULL;
+	return p->ok;
+}
+
+/*
+ * Stream a multipart/form-data body of "len" bytes (as returned by
+ * upload_stream_init()) from standard input, writing each part named
+ * "field" that has a file name into that file relative to "dfd".
+ * Other parts are skipped.
+ * Memory use is bounded by UPLOAD_BUFSZ regardless of body size.
+ * Unlike the buffered path, files are written as they're encountered,
+ * so a bad file name only stops the upload at that point.
+ * Reading is serial, but each file is published (see upload_publish())
+ * while the next is read, with up to WRITEJOBS publications at once.
+ * Returns -1 on a file name security violation, zero on system error,
+ * and non-zero on success.
+ */
+int
+upload_stream(const struct sys *sys, int dfd,
+	int64_t len, const char *field)
+{
+	struct upload	*up;
+	const char	*ct, *cp;
+	char		*hdr, *eoh, *line, *name, *file, *val;
+#ifdef DEDUP
+	SHA2_CTX	 ctx;
+#endif
+	struct uppub	 pub[WRITEJOBS], *p;
+	size_t		 sz, i;
+	int64_t		 total = 0;
+	int		 rc = 0, failed = 0, files = 0;
+	struct rusage	 ru;
+
+	/* Get our boundary out of the content type. */
+
+	ct = getenv("CONTENT_TYPE");
+	if (ct == NULL || (cp = strcasestr(ct, "boundary=")) == NULL) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"upload: no boundary");
+		return 0;
+	}
+	cp += 9;
+	if (*cp == '"')
+		cp++;
+	sz = strcspn(cp, "\";");
+	if (sz == 0 || sz > 70) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"upload: bad boundary");
+		return 0;
+	}
+
+	memset(pub, 0, sizeof(pub));
+	for (i = 0; i < WRITEJOBS; i++)
+		pub[i].ok = 1;
+
+	up = kcalloc(1, sizeof(struct upload));
+	up->left = len;
+	up->delimsz = snprintf(up->delim, sizeof(up->delim),
+		"\r\n--%.*s", (int)sz, cp);
+
+	/*
+	 * The first delimiter has no leading CRLF: pretend it does,
+	 * then skip the preamble.
+	 */
+
+	up->buf[0] = '\r';
+	up->buf[1] = '\n';
+	up->bufsz = 2;
+	if (upload_part(sys, up, -1, NULL) < 0)
+		goto out;
+
+	for (;;) {
+		/* After a delimiter: "--" ends the body. */
+
+		if (up->bufsz < 2 && ! upload_fill(sys, up))
+			goto out;
+		if (up->bufsz >= 2 && memcmp(up->buf, "--", 2) == 0)
+			break;
+		if (up->bufsz < 2 || memcmp(up->buf, "\r\n", 2) != 0) {
+			kutil_warnx(&sys->req, sys->curuser,
+				"upload: bad delimiter");
+			goto out;
+		}
+		upload_consume(up, 2);
+
+		/*
+		 * Part headers must fit in the window.
+		 * A bare CRLF means there are no headers at all.
+		 */
+
+		if ( ! upload_fill(sys, up))
+			goto out;
+		if (up->bufsz >= 2 && memcmp(up->buf, "\r\n", 2) == 0)
+			sz = 0;
+		else if ((eoh = memmem(up->buf,
+		    up->bufsz, "\r\n\r\n", 4)) != NULL)
+			sz = eoh - up->buf + 2;
+		else {
+			kutil_warnx(&sys->req, sys->curuser,
+				"upload: part headers too long");
+			goto out;
+		}
+
+		hdr = kmalloc(sz + 1);
+		memcpy(hdr, up->buf, sz);
+		hdr[sz] = '\0';
+		upload_consume(up, sz + 2);
+
+		name = file = NULL;
+		for (val = hdr; (line = strsep(&val, "\n")) != NULL; ) {
+			line[strcspn(line, "\r")] = '\0';
+			if (strncasecmp(line,
+			    "Content-Disposition:", 20) == 0)
+				upload_disposition(line + 20,
+					&name, &file);
+		}
+
+		if (name == NULL || strcmp(name, field) ||
+		    file == NULL || file[0] == '\0') {
+			free(hdr);
+			if (upload_part(sys, up, -1, NULL) < 0)
+				goto out;
+			continue;
+		}
+
+		if (strchr(file, '/') != NULL || file[0] == '.') {
+			kutil_warnx(&sys->req, sys->curuser,
+				"%s/%s: filename security violation",
+				sys->resource, file);
+			free(hdr);
+			rc = -1;
+			goto out;
+		}
+
+		/* Reuse the oldest slot once its file is published. */
+
+		p = &pub[files % WRITEJOBS];
+		if ( ! upload_publish_wait(p)) {
+			free(hdr);
+			goto out;
+		}
+
+		if ((p->fd = stage_open(sys, dfd, file,
+		    p->tmp, sizeof(p->tmp))) == -1) {
+			free(hdr);
+			goto out;
+		}
+#ifdef DEDUP
+		SHA256Init(&ctx);
+		p->size = upload_part(sys, up, p->fd, &ctx);
+		SHA256End(&ctx, p->hex);
+		p->hashed = 1;
+#else
+		p->size = upload_part(sys, up, p->fd, NULL);
+#endif
+		if (p->size < 0) {
+			stage_close(sys, dfd, p->fd, p->tmp, file, 0, NULL);
+			kutil_warnx(&sys->req, sys->curuser,
+				"%s/%s: upload failed",
+				sys->resource, file);
+			free(hdr);
+			goto out;
+		}
+
+		p->sys = sys;
+		p->dfd = dfd;
+		p->file = kstrdup(file);
+		free(hdr);
+		if (pthread_create(&p->thr, NULL, upload_publish, p) == 0)
+			p->busy = 1;
+		else
+			upload_publish(p);
+		total += p->size;
+		files++;
+	}
+
+	rc = 1;
+out:
+	for (i = 0; i < WRITEJOBS; i++)
+		if ( ! upload_publish_wait(&pub[i]))
+			failed = 1;
+	if (failed && rc > 0)
+		rc = 0;
+	if (getrusage(RUSAGE_SELF, &ru) != -1)
+		kutil_info(&sys->req, sys->curuser,
+			"%s: streamed %d files, %" PRId64 " bytes, "
+			"peak RSS %ld KB", sys->resource, files,
+			total, ru.ru_maxrss);
+	free(up);
+	return rc;
+}
+
+/*
+ * Files of the upload session "id" in UPLOADDIR: the staged data
+ * itself, a map of one byte per chunk (non-zero if received), and the
+ * session information.
+ */
+#define	UPSESS_MAP ".map"
+#define	UPSESS_INFO ".info"
+
+/*
+ * Number of chunks in an upload of "size" bytes.
+ * An empty upload still has one (empty) chunk.
+ */
+static size_t
+upsess_chunks(int64_t size)
+{
+
+	return size == 0 ? 1 :
+		(size + UPLOAD_CHUNKSZ - 1) / UPLOAD_CHUNKSZ;
+}
+
+void
+upsess_free(struct upsess *p)
+{
+
+	if (p == NULL)
+		return;
+	free(p->file);
+	p->file = NULL;
+}
+
+/*
+ * Remove the sessions in "updfd" abandoned for UPLOAD_MAXAGE, i.e.,
+ * whose data hasn't been written to since.
+ */
+static void
+upsess_reap(const struct sys *sys, int updfd)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	int		 fd;
+	time_t		 old = time(NULL) - UPLOAD_MAXAGE;
+
+	if ((fd = dup(updfd)) == -1 || (dir = fdopendir(fd)) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s: fdopendir", UPLOADDIR);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	rewinddir(dir);
+
+	/* Session data files are named only by their identifier. */
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (strchr(dp->d_name, '.') != NULL)
+			continue;
+		if (fstatat(updfd, dp->d_name,
+		    &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    ! S_ISREG(st.st_mode) || st.st_mtime >= old)
+			continue;
+		kutil_info(&sys->req, sys->curuser,
+			"%s/%s: upload abandoned", UPLOADDIR, dp->d_name);
+		upsess_remove(sys, updfd, dp->d_name);
+	}
+	closedir(dir);
+}
+
+/*
+ * Start a chunked upload of "file" of "size" bytes into the current
+ * directory, first removing abandoned sessions.
+ * This creates an empty (sparse) staging file of the full size, a
+ * chunk map, and the information needed to resume and commit it.
+ * Returns -1 on system error, zero if "size" is over UPLOAD_MAXSZ, and
+ * non-zero on success.
+ */
+int
+upsess_create(const struct sys *sys, int updfd,
+	const char *file, int64_t size, struct upsess *p)
+{
+	int	 fd = -1, mfd = -1, ifd = -1;
+	char	 buf[64];
+	FILE	*f;
+
+	memset(p, 0, sizeof(struct upsess));
+
+	if (size > UPLOAD_MAXSZ) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: upload too large: %" PRId64 " bytes",
+			sys->resource, file, size);
+		return 0;
+	}
+	upsess_reap(sys, updfd);
+
+	p->size = size;
+	p->chunks = upsess_chunks(size);
+
+	do {
+		snprintf(p->id, sizeof(p->id), "%08" PRIx32 "%08" PRIx32,
+			arc4random(), arc4random());
+		fd = openat(updfd, p->id, O_RDWR|O_CREAT|O_EXCL, 0600);
+	} while (fd == -1 && errno == EEXIST);
+
+	if (fd == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, p->id);
+		return -1;
+	} else if (ftruncate(fd, size) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: ftruncate", UPLOADDIR, p->id);
+		goto err;
+	}
+
+	snprintf(buf, sizeof(buf), "%s" UPSESS_MAP, p->id);
+	if ((mfd = openat(updfd, buf, O_RDWR|O_CREAT|O_EXCL, 0600)) == -1 ||
+	    ftruncate(mfd, p->chunks) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, buf);
+		goto err;
+	}
+
+	/* Information last: this marks the session as valid. */
+
+	snprintf(buf, sizeof(buf), "%s" UPSESS_INFO, p->id);
+	if ((ifd = openat(updfd, buf, O_WRONLY|O_CREAT|O_EXCL, 0600)) == -1 ||
+	    (f = fdopen(ifd, "w")) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, buf);
+		goto err;
+	}
+	ifd = -1;
+	fprintf(f, "%s\n%s\n%s\n%" PRId64 "\n",
+		sys->curuser == NULL ? "" : sys->curuser,
+		sys->resource, file, size);
+	if (fclose(f) == EOF) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, buf);
+		goto err;
+	}
+
+	close(fd);
+	close(mfd);
+	p->file = kstrdup(file);
+	kutil_info(&sys->req, sys->curuser,
+		"%s/%s: upload %s started: %" PRId64 " bytes",
+		sys->resource, file, p->id, size);
+	return 1;
+err:
+	if (ifd != -1)
+		close(ifd);
+	if (mfd != -1)
+		close(mfd);
+	close(fd);
+	upsess_remove(sys, updfd, p->id);
+	return -1;
+}
+
+/*
+ * Remove all files of the session "id", if found.
+ */
+void
+upsess_remove(const struct sys *sys, int updfd, const char *id)
+{
+	char		 buf[64];
+	const char	*sfx[] = { UPSESS_INFO, UPSESS_MAP, "" };
+	size_t		 i;
+
+	for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+		snprintf(buf, sizeof(buf), "%s%s", id, sfx[i]);
+		if (unlinkat(updfd, buf, 0) == -1 && errno != ENOENT)
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s", UPLOADDIR, buf);
+	}
+}
+
+/*
+ * Look up the session "id", which must belong to the current user and
+ * directory.
+ * Returns -1 on system error, zero if not found, non-zero on success.
+ */
+int
+upsess_open(const struct sys *sys, int updfd,
+	const char *id, struct upsess *p)
+{
+	char		 buf[64];
+	char		*line[4] = { NULL, NULL, NULL, NULL };
+	size_t		 linesz, i;
+	ssize_t		 len;
+	int		 fd, rc = 0;
+	FILE		*f;
+	const char	*er;
+
+	memset(p, 0, sizeof(struct upsess));
+
+	/* Session identifiers are ours: hexadecimal only. */
+
+	if (strlen(id) != 16 || strspn(id, "0123456789abcdef") != 16)
+		return 0;
+
+	snprintf(buf, sizeof(buf), "%s" UPSESS_INFO, id);
+	if ((fd = openat(updfd, buf, O_RDONLY, 0)) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, buf);
+		return -1;
+	} else if ((f = fdopen(fd, "r")) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, buf);
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		linesz = 0;
+		if ((len = getline(&line[i], &linesz, f)) <= 0 ||
+		    line[i][len - 1] != '\n') {
+			kutil_warnx(&sys->req, sys->curuser,
+				"%s/%s: bad syntax", UPLOADDIR, buf);
+			rc = -1;
+			goto out;
+		}
+		line[i][len - 1] = '\0';
+	}
+
+	if (strcmp(line[0], sys->curuser == NULL ?
+	    "" : sys->curuser) || strcmp(line[1], sys->resource)) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: session owner mismatch", UPLOADDIR, buf);
+		goto out;
+	}
+
+	p->size = strtonum(line[3], 0, INT64_MAX, &er);
+	if (er != NULL) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: bad size", UPLOADDIR, buf);
+		rc = -1;
+		goto out;
+	}
+
+	strlcpy(p->id, id, sizeof(p->id));
+	p->chunks = upsess_chunks(p->size);
+	p->file = line[2];
+	line[2] = NULL;
+	rc = 1;
+out:
+	for (i = 0; i < 4; i++)
+		free(line[i]);
+	fclose(f);
+	return rc;
+}
+
+/*
+ * Write chunk number "chunk" of the session with contents "buf" of
+ * size "sz", which must be exactly the chunk's size.
+ * Chunks may arrive in any order, repeatedly, and concurrently.
+ * Returns -1 on system error, zero on a bad chunk, non-zero on success.
+ */
+int
+upsess_write(const struct sys *sys, int updfd,
+	const struct upsess *p, size_t chunk, const char *buf, size_t sz)
+{
+	int		 fd, mfd, rc = -1;
+	off_t		 off;
+	size_t		 want, done;
+	ssize_t		 ssz;
+	char		 fn[64];
+	const char	 have = 1;
+
+	if (chunk >= p->chunks)
+		return 0;
+	off = (off_t)chunk * UPLOAD_CHUNKSZ;
+	want = p->size - off > UPLOAD_CHUNKSZ ?
+		UPLOAD_CHUNKSZ : (size_t)(p->size - off);
+	if (sz != want)
+		return 0;
+
+	if ((fd = openat(updfd, p->id, O_WRONLY, 0)) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, p->id);
+		return -1;
+	}
+	snprintf(fn, sizeof(fn), "%s" UPSESS_MAP, p->id);
+	if ((mfd = openat(updfd, fn, O_WRONLY, 0)) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, fn);
+		close(fd);
+		return -1;
+	}
+
+	for (done = 0; done < sz; done += ssz)
+		if ((ssz = pwrite(fd, buf + done,
+		    sz - done, off + done)) == -1) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: pwrite", UPLOADDIR, p->id);
+			goto out;
+		}
+
+	/* Only mark the chunk once its data is in place. */
+
+	if (pwrite(mfd, &have, 1, chunk) != 1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: pwrite", UPLOADDIR, fn);
+		goto out;
+	}
+	rc = 1;
+out:
+	close(mfd);
+	close(fd);
+	return rc;
+}
+
+/*
+ * Get the received state of all chunks as a string of '0' (missing)
+ * and '1' (received) characters.
+ * Returns NULL on system error.
+ */
+char *
+upsess_have(const struct sys *sys, int updfd, const struct upsess *p)
+{
+	int	 fd;
+	char	 fn[64], *buf;
+	ssize_t	 ssz;
+	size_t	 i;
+
+	snprintf(fn, sizeof(fn), "%s" UPSESS_MAP, p->id);
+	if ((fd = openat(updfd, fn, O_RDONLY, 0)) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, fn);
+		return NULL;
+	}
+
+	buf = kcalloc(p->chunks + 1, 1);
+	ssz = pread(fd, buf, p->chunks, 0);
+	close(fd);
+
+	if (ssz == -1 || (size_t)ssz != p->chunks) {
+		kutil_warnx(&sys->req, sys->curuser,
+			"%s/%s: short read", UPLOADDIR, fn);
+		free(buf);
+		return NULL;
+	}
+
+	for (i = 0; i < p->chunks; i++)
+		buf[i] = buf[i] ? '1' : '0';
+	return buf;
+}
+
+/*
+ * If all chunks have been received, move the staged file into the
+ * current directory "dfd" under its name and remove the session.
+ * Returns -1 on system error, zero if chunks are missing, non-zero on
+ * success.
+ */
+int
+upsess_commit(const struct sys *sys, int updfd,
+	const struct upsess *p, int dfd)
+{
+	char		*have;
+	struct stage	 stg;
+#ifdef DEDUP
+	int	 fd;
+	char	 hex[SHA256_DIGEST_STRING_LENGTH];
+#endif
+
+	if ((have = upsess_have(sys, updfd, p)) == NULL)
+		return -1;
+	if (strchr(have, '0') != NULL) {
+		free(have);
+		return 0;
+	}
+	free(have);
+
+#ifdef DEDUP
+	if ((fd = openat(updfd, p->id, O_RDONLY, 0)) == -1 ||
+	    ! dedup_hash_fd(fd, hex)) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s", UPLOADDIR, p->id);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	stage_begin(sys, dfd, p->file, &stg);
+	if ( ! dedup_publish(sys, updfd, p->id, dfd, p->file, hex)) {
+		stage_done(sys, dfd, p->file, &stg, 0);
+		return -1;
+	}
+#else
+	stage_begin(sys, dfd, p->file, &stg);
+	if (renameat(updfd, p->id, dfd, p->file) == -1) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s/%s: renameat", sys->resource, p->file);
+		stage_done(sys, dfd, p->file, &stg, 0);
+		return -1;
+	}
+#endif
+	stage_done(sys, dfd, p->file, &stg, 1);
+
+	kutil_info(&sys->req, sys->curuser,
+		"%s/%s: wrote %" PRId64 " bytes (upload %s)",
+		sys->resource, p->file, p->size, p->id);
+	upsess_remove(sys, updfd, p->id);
+	return 1;
+}
@@ -0,0 +1,364 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2021 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <zlib.h>
+
+#include "extern.h"
+
+/*
+ * A ZIP archive written as a stream: each file is emitted as it's read
+ * in "store" mode with a trailing data descriptor (so its CRC needn't be
+ * known in advance), followed by the central directory.
+ * Nothing is buffered but the (small) central directory records.
+ * ZIP64 extensions are used per entry only when sizes or offsets
+ * overflow 32 bits.
+ */
+
+#define	ZIP_MAX32	 0xffffffffULL
+#define	ZIP_MAX16	 0xffff
+#define	ZIP_FLAGS	 (0x0008 | 0x0800) /* descriptor, UTF-8 */
+#define	ZIP_VERSION	 20 /* version needed: store */
+#define	ZIP_VERSION64	 45 /* version needed: ZIP64 */
+
+/*
+ * What we need to remember of each entry for the central directory.
+ */
+struct	zent {
+	char		*name; /* name in archive */
+	uint32_t	 crc; /* CRC-32 of contents */
+	uint64_t	 size; /* size of contents */
+	uint64_t	 off; /* offset of local header */
+	uint16_t	 dtime; /* MS-DOS time */
+	uint16_t	 ddate; /* MS-DOS date */
+	uint32_t	 mode; /* file mode */
+	int		 zip64; /* local header used ZIP64 */
+};
+
+/*
+ * The output stream.
+ */
+struct	zout {
+	struct kreq	*req;
+	uint64_t	 off; /* bytes written so far */
+	int		 live; /* client still there? */
+};
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+
+	put16(p, v & 0xffff);
+	put16(p + 2, (v >> 16) & 0xffff);
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+
+	put32(p, v & 0xffffffff);
+	put32(p + 4, (v >> 32) & 0xffffffff);
+}
+
+/*
+ * Write to the client, tracking our offset.
+ * Returns zero if the client has gone away.
+ */
+static int
+zwrite(struct zout *z, const void *buf, size_t sz)
+{
+
+	if (z->live && sz > 0 &&
+	    khttp_write(z->req, buf, sz) != KCGI_OK)
+		z->live = 0;
+	z->off += sz;
+	return z->live;
+}
+
+/*
+ * Convert a modification time into MS-DOS time and date.
+ */
+static void
+zip_dostime(time_t t, uint16_t *dtime, uint16_t *ddate)
+{
+	struct tm	 tm;
+
+	if (localtime_r(&t, &tm) == NULL || tm.tm_year < 80) {
+		*dtime = 0;
+		*ddate = (1 << 5) | 1; /* 1980-01-01 */
+		return;
+	}
+	*dtime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	*ddate = ((tm.tm_year - 80) << 9) |
+		((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+/*
+ * Stream one entry "e" from the open file "fd".
+ * Reads at most e->size bytes (the size when we listed it), then sets
+ * e->size to what was actually read.
+ * Returns zero on failure (read error or client gone).
+ */
+static int
+zip_entry(const struct sys *sys, struct zout *z, struct zent *e, int fd)
+{
+	static char	 buf[256 * 1024];
+	unsigned char	 hdr[30 + 20], dd[24];
+	size_t		 namesz = strlen(e->name), sz, hsz;
+	ssize_t		 ssz;
+	uint64_t	 left = e->size, done = 0;
+
+	e->off = z->off;
+	e->zip64 = e->size >= ZIP_MAX32;
+	e->crc = crc32(0L, Z_NULL, 0);
+
+	put32(hdr, 0x04034b50);
+	put16(hdr + 4, e->zip64 ? ZIP_VERSION64 : ZIP_VERSION);
+	put16(hdr + 6, ZIP_FLAGS);
+	put16(hdr + 8, 0); /* stored */
+	put16(hdr + 10, e->dtime);
+	put16(hdr + 12, e->ddate);
+	put32(hdr + 14, 0); /* CRC in descriptor */
+	put32(hdr + 18, e->zip64 ? ZIP_MAX32 : 0);
+	put32(hdr + 22, e->zip64 ? ZIP_MAX32 : 0);
+	put16(hdr + 26, namesz);
+	put16(hdr + 28, e->zip64 ? 20 : 0);
+	hsz = 30;
+	if (e->zip64) {
+		put16(hdr + 30, 0x0001);
+		put16(hdr + 32, 16);
+		put64(hdr + 34, 0);
+		put64(hdr + 42, 0);
+		hsz += 20;
+	}
+
+	if ( ! zwrite(z, hdr, 30) || ! zwrite(z, e->name, namesz) ||
+	    ! zwrite(z, hdr + 30, hsz - 30))
+		return 0;
+
+	while (left > 0) {
+		sz = left > sizeof(buf) ? sizeof(buf) : left;
+		if ((ssz = read(fd, buf, sz)) == -1) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: read", sys->resource, e->name);
+			return 0;
+		} else if (ssz == 0)
+			break;
+		e->crc = crc32(e->crc, (Bytef *)buf, ssz);
+		if ( ! zwrite(z, buf, ssz))
+			return 0;
+		left -= ssz;
+		done += ssz;
+	}
+	e->size = done;
+
+	put32(dd, 0x08074b50);
+	put32(dd + 4, e->crc);
+	if (e->zip64) {
+		put64(dd + 8, e->size);
+		put64(dd + 16, e->size);
+		return zwrite(z, dd, 24);
+	}
+	put32(dd + 8, e->size);
+	put32(dd + 12, e->size);
+	return zwrite(z, dd, 16);
+}
+
+/*
+ * Write the central directory of "ents" of size "entsz", followed by
+ * the (ZIP64, if needed) end of central directory records.
+ */
+static void
+zip_finish(struct zout *z, const struct zent *ents, size_t entsz)
+{
+	unsigned char	 hdr[46 + 28], end[56 + 20 + 22];
+	size_t		 i, namesz, xsz;
+	uint64_t	 cdoff = z->off, cdsz, eoff;
+	const struct zent *e;
+	int		 zip64;
+
+	for (i = 0; i < entsz; i++) {
+		e = &ents[i];
+		namesz = strlen(e->name);
+		zip64 = e->zip64 ||
+			e->size >= ZIP_MAX32 || e->off >= ZIP_MAX32;
+
+		put32(hdr, 0x02014b50);
+		put16(hdr + 4, (3 << 8) | ZIP_VERSION64); /* UNIX */
+		put16(hdr + 6, zip64 ? ZIP_VERSION64 : ZIP_VERSION);
+		put16(hdr + 8, ZIP_FLAGS);
+		put16(hdr + 10, 0);
+		put16(hdr + 12, e->dtime);
+		put16(hdr + 14, e->ddate);
+		put32(hdr + 16, e->crc);
+		put32(hdr + 20, zip64 ? ZIP_MAX32 : e->size);
+		put32(hdr + 24, zip64 ? ZIP_MAX32 : e->size);
+		put16(hdr + 28, namesz);
+		put16(hdr + 30, zip64 ? 28 : 0);
+		put16(hdr + 32, 0); /* comment */
+		put16(hdr + 34, 0); /* disk */
+		put16(hdr + 36, 0); /* internal attributes */
+		put32(hdr + 38, e->mode << 16);
+		put32(hdr + 42, zip64 ? ZIP_MAX32 : e->off);
+		xsz = 0;
+		if (zip64) {
+			put16(hdr + 46, 0x0001);
+			put16(hdr + 48, 24);
+			put64(hdr + 50, e->size);
+			put64(hdr + 58, e->size);
+			put64(hdr + 66, e->off);
+			xsz = 28;
+		}
+		zwrite(z, hdr, 46);
+		zwrite(z, e->name, namesz);
+		zwrite(z, hdr + 46, xsz);
+	}
+
+	cdsz = z->off - cdoff;
+	eoff = z->off;
+	zip64 = entsz >= ZIP_MAX16 ||
+		cdsz >= ZIP_MAX32 || cdoff >= ZIP_MAX32;
+
+	if (zip64) {
+		put32(end, 0x06064b50);
+		put64(end + 4, 44);
+		put16(end + 12, (3 << 8) | ZIP_VERSION64);
+		put16(end + 14, ZIP_VERSION64);
+		put32(end + 16, 0);
+		put32(end + 20, 0);
+		put64(end + 24, entsz);
+		put64(end + 32, entsz);
+		put64(end + 40, cdsz);
+		put64(end + 48, cdoff);
+		put32(end + 56, 0x07064b50);
+		put32(end + 60, 0);
+		put64(end + 64, eoff);
+		put32(end + 72, 1);
+		zwrite(z, end, 76);
+	}
+
+	put32(end, 0x06054b50);
+	put16(end + 4, 0);
+	put16(end + 6, 0);
+	put16(end + 8, zip64 ? ZIP_MAX16 : entsz);
+	put16(end + 10, zip64 ? ZIP_MAX16 : entsz);
+	put32(end + 12, zip64 ? ZIP_MAX32 : cdsz);
+	put32(end + 16, zip64 ? ZIP_MAX32 : cdoff);
+	put16(end + 20, 0);
+	zwrite(z, end, 22);
+}
+
+/*
+ * Stream a ZIP archive of the regular non-dot files in the directory
+ * "nfd" to the client, whose headers must already have been sent.
+ * Files that can't be opened are skipped.
+ * Returns zero if the archive could not be completed.
+ */
+int
+zip_stream(const struct sys *sys, int nfd)
+{
+	int		 nnfd, fd, rc = 0;
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 st;
+	struct zent	*ents = NULL;
+	size_t		 entsz = 0, entmax = 0, i;
+	struct zout	 z;
+
+	memset(&z, 0, sizeof(struct zout));
+	z.req = (struct kreq *)&sys->req;
+	z.live = 1;
+
+	/*
+	 * We make a copy of nfd because fdopendir() will swallow the
+	 * descriptor and close it on closedir().
+	 */
+
+	if ((nnfd = dup(nfd)) == -1) {
+		kutil_warn(&sys->req, sys->curuser, "dup");
+		return 0;
+	} else if ((dir = fdopendir(nnfd)) == NULL) {
+		kutil_warn(&sys->req, sys->curuser,
+			"%s: fdopendir", sys->resource);
+		close(nnfd);
+		return 0;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_type != DT_REG || dp->d_name[0] == '.')
+			continue;
+		if ((fd = openat(nfd, dp->d_name, O_RDONLY, 0)) == -1) {
+			kutil_warn(&sys->req, sys->curuser,
+				"%s/%s: openat", sys->resource,
+				dp->d_name);
+			continue;
+		} else if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			continue;
+		}
+
+		if (entsz == entmax) {
+			entmax = entmax == 0 ? 64 : entmax * 2;
+			ents = kreallocarray(ents,
+				entmax, sizeof(struct zent));
+		}
+		memset(&ents[entsz], 0, sizeof(struct zent));
+		ents[entsz].name = kstrdup(dp->d_name);
+		ents[entsz].size = st.st_size;
+		ents[entsz].mode = st.st_mode & 07777;
+		ents[entsz].mode |= S_IFREG;
+		zip_dostime(st.st_mtime,
+			&ents[entsz].dtime, &ents[entsz].ddate);
+
+		rc = zip_entry(sys, &z, &ents[entsz++], fd);
+		close(fd);
+		if ( ! rc)
+			goto out;
+	}
+
+	zip_finish(&z, ents, entsz);
+	rc = z.live;
+	kutil_info(&sys->req, sys->curuser,
+		"%s: zip of %zu files, %" PRIu64 " bytes%s",
+		sys->resource, entsz, z.off, rc ? "" : " (incomplete)");
+out:
+	closedir(dir);
+	for (i = 0; i < entsz; i++)
+		free(ents[i].name);
+	free(ents);
+	return rc;
+}